@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+/*
+ * Offline analysis of a capture file. Frames are decoded straight from
+ * the mapping with the decoders of the live view. The capture is split
+ * in chunks of frames, spread evenly over workers at first. A worker
+ * out of chunks steals the second half of the chunks left to another
+ * one. Each worker reduces into results of its own, merged at the end.
+ *
+ * Sums are kept as integers, relative to the first frame, so that
+ * results are exact and do not depend on the number of workers or on
+ * the order chunks are done in. Histograms need the range of values,
+ * they are built in a second pass.
+ */
+
+/* Frames per chunk */
+#define HM_ANALYSIS_CHUNK 256
+
+/* What a pass does with a frame */
+typedef void (*hm_analysis_fn)(struct hm_analysis *, const struct hm_analysis *,
+                               const struct hm_frame *, const struct hm_frame *,
+                               size_t);
+
+struct hm_analysis_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    size_t next;		/* Chunks left, from next to end */
+    size_t end;
+    struct hm_analysis part;	/* Results of this worker */
+    struct hm_frame frame;
+    struct hm_frame prev;
+    int error;
+    struct hm_analysis_pool *pool;
+};
+
+struct hm_analysis_pool {
+    struct hm_replay *replay;
+    const struct hm_analysis *shared;	/* Geometry, reference, range */
+    hm_analysis_fn fn;
+    bool previous;		/* Passes need the previous frame */
+    size_t chunks;
+    unsigned int workers;
+    struct hm_analysis_worker *worker;
+};
+
+static int
+hm_analysis_alloc(struct hm_analysis *a, size_t len, unsigned int bins)
+{
+    a->len = len;
+    a->bins = bins;
+    a->sum = calloc(len, sizeof(int64_t));
+    a->sqlo = calloc(len, sizeof(uint64_t));
+    a->sqhi = calloc(len, sizeof(uint64_t));
+    a->ref = calloc(len, sizeof(int));
+    a->min = malloc(len * sizeof(int));
+    a->max = malloc(len * sizeof(int));
+    a->crossings = calloc(len, sizeof(unsigned long));
+    a->peaks = calloc(len, sizeof(unsigned long));
+    a->hist = calloc(len * bins, sizeof(unsigned long));
+    if (a->sum == NULL || a->sqlo == NULL || a->sqhi == NULL ||
+        a->ref == NULL || a->min == NULL || a->max == NULL ||
+        a->crossings == NULL || a->peaks == NULL || a->hist == NULL)
+        return -1;
+    for (size_t i = 0; i < len; i++) {
+        a->min[i] = INT_MAX;
+        a->max[i] = INT_MIN;
+    }
+    a->peak = INT_MIN;
+    return 0;
+}
+
+void
+hm_analysis_free(struct hm_analysis *a)
+{
+    free(a->sum);
+    free(a->sqlo);
+    free(a->sqhi);
+    free(a->ref);
+    free(a->min);
+    free(a->max);
+    free(a->crossings);
+    free(a->peaks);
+    free(a->hist);
+    a->sum = NULL;
+    a->sqlo = a->sqhi = NULL;
+    a->ref = a->min = a->max = NULL;
+    a->crossings = a->peaks = a->hist = NULL;
+}
+
+/* First pass: sums, extents, crossings and peaks */
+static void
+hm_analysis_reduce(struct hm_analysis *a, const struct hm_analysis *shared,
+                   const struct hm_frame *frame, const struct hm_frame *prev,
+                   size_t n)
+{
+    const int *x = frame->data;
+    const int *ref = shared->ref;
+    for (size_t i = 0; i < a->len; i++) {
+        int64_t d = (int64_t)x[i] - ref[i];
+        uint64_t m = d < 0 ? -d : d;
+        uint64_t sq = m * m;
+        a->sum[i] += d;
+        a->sqlo[i] += sq;
+        a->sqhi[i] += a->sqlo[i] < sq;
+        if (x[i] < a->min[i]) a->min[i] = x[i];
+        if (x[i] > a->max[i]) a->max[i] = x[i];
+    }
+    a->frames++;
+    if (!shared->thresholded) return;
+
+    int threshold = shared->threshold;
+    if (prev)
+        for (size_t i = 0; i < a->len; i++)
+            a->crossings[i] += prev->data[i] < threshold && x[i] >= threshold;
+    size_t peak = 0;
+    for (size_t i = 1; i < a->len; i++)
+        if (x[i] > x[peak]) peak = i;
+    if (x[peak] >= threshold) a->peaks[peak]++;
+    if (x[peak] > a->peak || (x[peak] == a->peak && n < a->peakframe)) {
+        a->peak = x[peak];
+        a->peakcell = peak;
+        a->peakframe = n;
+    }
+}
+
+/* Second pass: histograms over the range of all values */
+static void
+hm_analysis_histogram(struct hm_analysis *a, const struct hm_analysis *shared,
+                      const struct hm_frame *frame, const struct hm_frame *prev,
+                      size_t n)
+{
+    (void)prev;
+    (void)n;
+    unsigned long *h = a->hist;
+    for (size_t i = 0; i < a->len; i++, h += a->bins)
+        h[((uint64_t)((int64_t)frame->data[i] - shared->low) * shared->scale) >> 32]++;
+    a->frames++;
+}
+
+/* Next chunk for worker w, stolen from others when it has none left */
+static bool
+hm_analysis_chunk(struct hm_analysis_pool *pool, unsigned int w, size_t *chunk)
+{
+    struct hm_analysis_worker *self = &pool->worker[w];
+    pthread_mutex_lock(&self->lock);
+    bool found = self->next < self->end;
+    if (found) *chunk = self->next++;
+    pthread_mutex_unlock(&self->lock);
+    if (found) return true;
+
+    for (unsigned int k = 1; k < pool->workers; k++) {
+        struct hm_analysis_worker *victim = &pool->worker[(w + k) % pool->workers];
+        size_t start, end;
+        pthread_mutex_lock(&victim->lock);
+        end = victim->end;
+        start = end - (end - victim->next) / 2;
+        if (start == end && victim->next < end) start = end - 1;
+        victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+        if (start == end) continue;
+
+        *chunk = start;
+        pthread_mutex_lock(&self->lock);
+        self->next = start + 1;
+        self->end = end;
+        pthread_mutex_unlock(&self->lock);
+        return true;
+    }
+    return false;
+}
+
+static void *
+hm_analysis_run(void *arg)
+{
+    struct hm_analysis_worker *worker = arg;
+    struct hm_analysis_pool *pool = worker->pool;
+    struct hm_replay *replay = pool->replay;
+    size_t len = pool->shared->len;
+    unsigned int w = worker - pool->worker;
+    size_t chunk;
+
+    while (worker->error == 0 && hm_analysis_chunk(pool, w, &chunk)) {
+        size_t first = chunk * HM_ANALYSIS_CHUNK;
+        size_t last = first + HM_ANALYSIS_CHUNK;
+        if (last > replay->frames) last = replay->frames;
+
+        /* Crossings at the start of a chunk need the frame before */
+        bool previous = false;
+        if (pool->previous && first > 0) {
+            if (hm_replay_decode(replay, first - 1, &worker->prev) == -1) {
+                worker->error = errno;
+                break;
+            }
+            previous = (worker->prev.len == len);
+        }
+        for (size_t n = first; n < last; n++) {
+            if (hm_replay_decode(replay, n, &worker->frame) == -1) {
+                worker->error = errno;
+                break;
+            }
+            if (worker->frame.len != len) {
+                /* Frames of another geometry are left out */
+                worker->part.skipped++;
+                previous = false;
+                continue;
+            }
+            pool->fn(&worker->part, pool->shared, &worker->frame,
+                     previous ? &worker->prev : NULL, n);
+            if (pool->previous) {
+                struct hm_frame tmp = worker->prev;
+                worker->prev = worker->frame;
+                worker->frame = tmp;
+                previous = true;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Run a pass over the whole capture with workers threads, each one
+ * reducing into its part */
+static int
+hm_analysis_pass(struct hm_analysis_pool *pool)
+{
+    unsigned int started = 0;
+    int error = 0;
+    for (unsigned int w = 0; w < pool->workers; w++) {
+        struct hm_analysis_worker *worker = &pool->worker[w];
+        worker->next = pool->chunks * w / pool->workers;
+        worker->end = pool->chunks * (w + 1) / pool->workers;
+        worker->error = 0;
+    }
+    for (; started < pool->workers; started++) {
+        struct hm_analysis_worker *worker = &pool->worker[started];
+        if ((error = pthread_create(&worker->thread, NULL,
+                                    hm_analysis_run, worker)) != 0)
+            break;
+    }
+    for (unsigned int w = 0; w < started; w++) {
+        pthread_join(pool->worker[w].thread, NULL);
+        if (error == 0) error = pool->worker[w].error;
+    }
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Analyze all frames of a capture with threads workers. Crossings and
+ * peaks are only counted when thresholded. */
+int
+hm_analyze(struct hm_analysis *analysis, struct hm_replay *replay,
+           unsigned int threads, unsigned int bins, bool thresholded,
+           int threshold)
+{
+    struct hm_frame first = { 0 };
+    struct hm_analysis_pool pool = { 0 };
+    int ret = -1;
+
+    memset(analysis, 0, sizeof(*analysis));
+    if (replay->frames == 0 || bins == 0 || bins > HM_ANALYSIS_MAXBINS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (hm_replay_decode(replay, 0, &first) == -1) return -1;
+    if (hm_analysis_alloc(analysis, first.len, bins) == -1) goto done;
+    memcpy(analysis->ref, first.data, first.len * sizeof(int));
+    analysis->thresholded = thresholded;
+    analysis->threshold = threshold;
+
+    pool.replay = replay;
+    pool.shared = analysis;
+    pool.chunks = (replay->frames + HM_ANALYSIS_CHUNK - 1) / HM_ANALYSIS_CHUNK;
+    pool.workers = threads < 1 ? 1 : threads;
+    if (pool.workers > pool.chunks) pool.workers = pool.chunks;
+    pool.worker = calloc(pool.workers, sizeof(*pool.worker));
+    if (pool.worker == NULL) goto done;
+    for (unsigned int w = 0; w < pool.workers; w++) {
+        pool.worker[w].pool = &pool;
+        pthread_mutex_init(&pool.worker[w].lock, NULL);
+        if (hm_analysis_alloc(&pool.worker[w].part, first.len, bins) == -1)
+            goto done;
+    }
+
+    /* Sums and extents, merged so that the histograms get their range */
+    pool.fn = hm_analysis_reduce;
+    pool.previous = thresholded;
+    if (hm_analysis_pass(&pool) == -1) goto done;
+    for (unsigned int w = 0; w < pool.workers; w++) {
+        struct hm_analysis *part = &pool.worker[w].part;
+        for (size_t i = 0; i < analysis->len; i++) {
+            analysis->sum[i] += part->sum[i];
+            analysis->sqlo[i] += part->sqlo[i];
+            analysis->sqhi[i] += part->sqhi[i] + (analysis->sqlo[i] < part->sqlo[i]);
+            if (part->min[i] < analysis->min[i]) analysis->min[i] = part->min[i];
+            if (part->max[i] > analysis->max[i]) analysis->max[i] = part->max[i];
+            analysis->crossings[i] += part->crossings[i];
+            analysis->peaks[i] += part->peaks[i];
+        }
+        if (part->peak > analysis->peak ||
+            (part->peak == analysis->peak && part->frames &&
+             part->peakframe < analysis->peakframe)) {
+            analysis->peak = part->peak;
+            analysis->peakcell = part->peakcell;
+            analysis->peakframe = part->peakframe;
+        }
+        analysis->frames += part->frames;
+        analysis->skipped += part->skipped;
+        part->frames = part->skipped = 0;
+    }
+    analysis->low = INT_MAX;
+    analysis->high = INT_MIN;
+    for (size_t i = 0; i < analysis->len; i++) {
+        if (analysis->min[i] < analysis->low) analysis->low = analysis->min[i];
+        if (analysis->max[i] > analysis->high) analysis->high = analysis->max[i];
+    }
+    /* Bins as a fraction of 2^32, rounded down so that the largest value
+     * is still in the last bin */
+    analysis->scale = ((uint64_t)bins << 32) /
+        ((uint64_t)((int64_t)analysis->high - analysis->low) + 1);
+
+    pool.fn = hm_analysis_histogram;
+    pool.previous = false;
+    if (hm_analysis_pass(&pool) == -1) goto done;
+    for (unsigned int w = 0; w < pool.workers; w++) {
+        struct hm_analysis *part = &pool.worker[w].part;
+        for (size_t i = 0; i < analysis->len * bins; i++)
+            analysis->hist[i] += part->hist[i];
+    }
+    analysis->workers = pool.workers;
+    ret = 0;
+
+done:
+    if (ret == -1) {
+        int err = errno;
+        hm_analysis_free(analysis);
+        errno = err;
+    }
+    for (unsigned int w = 0; pool.worker && w < pool.workers; w++) {
+        hm_analysis_free(&pool.worker[w].part);
+        hm_frame_free(&pool.worker[w].frame);
+        hm_frame_free(&pool.worker[w].prev);
+        pthread_mutex_destroy(&pool.worker[w].lock);
+    }
+    free(pool.worker);
+    hm_frame_free(&first);
+    return ret;
+}
+
+/* Mean and sample variance of cell i */
+static void
+hm_analysis_moments(const struct hm_analysis *a, size_t i,
+                    long double *mean, long double *variance)
+{
+    long double n = a->frames;
+    long double sum = a->sum[i];
+    long double sq = a->sqhi[i] * 18446744073709551616.0L + a->sqlo[i];
+    *mean = a->ref[i] + sum / n;
+    *variance = a->frames > 1 ? (sq - sum * sum / n) / (n - 1) : 0;
+    if (*variance < 0) *variance = 0;
+}
+
+static void
+hm_analysis_matrix(const struct hm_analysis *a, unsigned int width, FILE *out,
+                   const char *title, int what)
+{
+    fprintf(out, "\n# %s\n", title);
+    for (size_t i = 0; i < a->len; i++) {
+        long double mean, variance;
+        hm_analysis_moments(a, i, &mean, &variance);
+        switch (what) {
+        case 0: fprintf(out, "%.3Lf", mean); break;
+        case 1: fprintf(out, "%.3Lf", sqrtl(variance)); break;
+        case 2: fprintf(out, "%d", a->min[i]); break;
+        case 3: fprintf(out, "%d", a->max[i]); break;
+        case 4: fprintf(out, "%lu", a->crossings[i]); break;
+        case 5: fprintf(out, "%lu", a->peaks[i]); break;
+        }
+        fputc((i + 1) % width == 0 || i + 1 == a->len ? '\n' : ' ', out);
+    }
+}
+
+/* Write results as matrices of width columns, then a histogram per
+ * cell */
+int
+hm_analysis_write(const struct hm_analysis *a, struct hm_replay *replay,
+                  FILE *out)
+{
+    unsigned int width = replay->width ? replay->width : a->len;
+    fprintf(out, "# %lu frames of %zu cells in rows of %u, %lu of another size skipped\n",
+            a->frames, a->len, width, a->skipped);
+    if (a->frames == 0) return ferror(out) ? -1 : 0;
+    hm_analysis_matrix(a, width, out, "mean", 0);
+    hm_analysis_matrix(a, width, out, "stddev", 1);
+    hm_analysis_matrix(a, width, out, "min", 2);
+    hm_analysis_matrix(a, width, out, "max", 3);
+    if (a->thresholded) {
+        char title[64];
+        snprintf(title, sizeof(title), "crossings of %d", a->threshold);
+        hm_analysis_matrix(a, width, out, title, 4);
+        snprintf(title, sizeof(title), "peaks of at least %d", a->threshold);
+        hm_analysis_matrix(a, width, out, title, 5);
+        fprintf(out, "\n# largest value %d at column %zu, row %zu of frame %zu, %.6f s\n",
+                a->peak, a->peakcell % width, a->peakcell / width, a->peakframe,
+                (hm_replay_timestamp(replay, a->peakframe) -
+                 hm_replay_timestamp(replay, 0)) / 1e9);
+    }
+
+    fprintf(out, "\n# histograms, column, row, then %u bins from %d to %d\n",
+            a->bins, a->low, a->high);
+    for (size_t i = 0; i < a->len; i++) {
+        fprintf(out, "%zu %zu", i % width, i / width);
+        for (unsigned int b = 0; b < a->bins; b++)
+            fprintf(out, " %lu", a->hist[i * a->bins + b]);
+        fputc('\n', out);
+    }
+    return ferror(out) ? -1 : 0;
+}
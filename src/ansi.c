@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+/*
+ * Renderer writing 24-bit color escape sequences directly to the
+ * terminal, without ncurses. A whole frame is composed in one buffer
+ * and written with a single write(). The cursor is only moved home
+ * between frames, the screen is cleared when the geometry changes.
+ */
+
+/* Number of levels of the colormap */
+#define HM_ANSI_LEVELS 256
+
+/* Longest SGR sequence for one level */
+#define HM_ANSI_SGR 48
+
+/* Largest range for which a lookup table is used */
+#define HM_ANSI_MAXLUT 65536
+
+static int
+hm_ansi_write(const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(STDOUT_FILENO, buf, len);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1) return -1;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+int
+hm_ansi_init(struct hm_ansi *ansi, struct hm_cfg *cfg)
+{
+    memset(ansi, 0, sizeof(*ansi));
+    ansi->sgr = malloc(HM_ANSI_LEVELS * HM_ANSI_SGR);
+    ansi->sgrlen = malloc(HM_ANSI_LEVELS * sizeof(*ansi->sgrlen));
+    ansi->half = malloc(2 * HM_ANSI_LEVELS * HM_ANSI_SGR);
+    ansi->halflen = malloc(2 * HM_ANSI_LEVELS * sizeof(*ansi->halflen));
+    if (ansi->sgr == NULL || ansi->sgrlen == NULL ||
+        ansi->half == NULL || ansi->halflen == NULL) {
+        hm_ansi_free(ansi);
+        return -1;
+    }
+
+    /* Precompute the escape sequence of each level: background from
+     * the colormap, foreground for values readable on it. */
+    for (int i = 0; i < HM_ANSI_LEVELS; i++) {
+        struct hm_color bg, fg = { 0, 0, 0 };
+        hm_display_color(cfg->gray, i, HM_ANSI_LEVELS, &bg);
+        if (cfg->gray)
+            hm_display_color(true, HM_ANSI_LEVELS - 1 - i, HM_ANSI_LEVELS, &fg);
+        ansi->sgrlen[i] = snprintf(ansi->sgr + i * HM_ANSI_SGR, HM_ANSI_SGR,
+                                   "\033[38;2;%d;%d;%d;48;2;%d;%d;%dm",
+                                   fg.red * 255 / 1000, fg.green * 255 / 1000,
+                                   fg.blue * 255 / 1000, bg.red * 255 / 1000,
+                                   bg.green * 255 / 1000, bg.blue * 255 / 1000);
+
+        /* Half blocks: foreground for upper rows, background for lower */
+        for (int h = 0; h < 2; h++)
+            ansi->halflen[h * HM_ANSI_LEVELS + i] =
+                snprintf(ansi->half + (h * HM_ANSI_LEVELS + i) * HM_ANSI_SGR,
+                         HM_ANSI_SGR, "\033[%d;2;%d;%d;%dm", h ? 48 : 38,
+                         bg.red * 255 / 1000, bg.green * 255 / 1000,
+                         bg.blue * 255 / 1000);
+    }
+
+    /* Alternate screen, no cursor */
+    static const char setup[] = "\033[?1049h\033[?25l";
+    if (hm_ansi_write(setup, sizeof(setup) - 1) == -1) {
+        hm_ansi_free(ansi);
+        return -1;
+    }
+    return 0;
+}
+
+void
+hm_ansi_free(struct hm_ansi *ansi)
+{
+    if (ansi->sgr) {
+        static const char restore[] = "\033[0m\033[?25h\033[?1049l";
+        hm_ansi_write(restore, sizeof(restore) - 1);
+    }
+    free(ansi->sgr);
+    free(ansi->sgrlen);
+    free(ansi->half);
+    free(ansi->halflen);
+    free(ansi->buf);
+    free(ansi->lut);
+    memset(ansi, 0, sizeof(*ansi));
+}
+
+/* Rebuild the value to level table if the range changed */
+static void
+hm_ansi_lut(struct hm_ansi *ansi, struct hm_cfg *cfg)
+{
+    if (ansi->lutvalid && ansi->lutmin == cfg->min && ansi->lutmax == cfg->max)
+        return;
+
+    ansi->lutvalid = true;
+    ansi->lutmin = cfg->min;
+    ansi->lutmax = cfg->max;
+    ansi->lutlen = 0;
+
+    int64_t len = (cfg->max > cfg->min) ?
+        (int64_t)cfg->max - cfg->min + 1 : 1;
+    if (len > HM_ANSI_MAXLUT) return;
+    if ((size_t)len > ansi->lutallocated) {
+        short *lut = realloc(ansi->lut, len * sizeof(short));
+        if (lut == NULL) return;
+        ansi->lut = lut;
+        ansi->lutallocated = len;
+    }
+    for (int64_t i = 0; i < len; i++)
+        ansi->lut[i] = hm_display_level(cfg->min, cfg->max, HM_ANSI_LEVELS,
+                                        cfg->min + i);
+    ansi->lutlen = len;
+}
+
+static inline int
+hm_ansi_level(struct hm_ansi *ansi, struct hm_cfg *cfg, int value)
+{
+    if (ansi->lutlen == 0)
+        return hm_display_level(cfg->min, cfg->max, HM_ANSI_LEVELS, value);
+    if (value <= ansi->lutmin) return ansi->lut[0];
+    if ((int64_t)value - ansi->lutmin >= (int64_t)ansi->lutlen)
+        return ansi->lut[ansi->lutlen - 1];
+    return ansi->lut[value - ansi->lutmin];
+}
+
+/* Redraw everything on next frame, after a resize */
+void
+hm_ansi_invalidate(struct hm_ansi *ansi)
+{
+    ansi->lines = 0;
+}
+
+/* Give the main screen back for a while, to write something there */
+void
+hm_ansi_suspend(struct hm_ansi *ansi)
+{
+    static const char suspend[] = "\033[0m\033[?25h\033[?1049l";
+    (void)ansi;
+    hm_ansi_write(suspend, sizeof(suspend) - 1);
+}
+
+void
+hm_ansi_resume(struct hm_ansi *ansi)
+{
+    static const char resume[] = "\033[?1049h\033[?25l";
+    hm_ansi_write(resume, sizeof(resume) - 1);
+    hm_ansi_invalidate(ansi);
+}
+
+/* Compose rows of half blocks: the upper half of each character shows a
+ * sensor row with the foreground color, the lower half the next one with
+ * the background color. Vertical positions are in half rows. */
+static char *
+hm_ansi_halfblock(struct hm_ansi *ansi, struct hm_cfg *cfg, int *data,
+                  size_t lines, size_t columns, size_t visible,
+                  size_t cwidth, size_t cheight, ssize_t offsetx,
+                  ssize_t offsety, int sheight, char *p)
+{
+    size_t first = offsety / 2;
+    size_t last = (offsety + cheight * lines + 1) / 2;
+    if (last > (size_t)sheight) last = sheight;
+
+    for (size_t y = first; y < last; y++) {
+        int previous[2] = { -1, -1 };
+        ssize_t rows[2];
+        for (int h = 0; h < 2; h++) {
+            ssize_t v = 2 * y + h - offsety;
+            rows[h] = (v >= 0 && (size_t)v < cheight * lines) ? v / (ssize_t)cheight : -1;
+        }
+        p += sprintf(p, "\033[%zu;%zdH", y + 1, offsetx + 1);
+        if (rows[1] == -1) {
+            memcpy(p, "\033[49m", 5);
+            p += 5;
+        }
+        for (size_t c = 0; c < visible; c++) {
+            for (int h = 0; h < 2; h++) {
+                if (rows[h] == -1) continue;
+                int level = hm_ansi_level(ansi, cfg, data[rows[h] * columns + c]);
+                if (level != previous[h]) {
+                    int i = h * HM_ANSI_LEVELS + level;
+                    memcpy(p, ansi->half + i * HM_ANSI_SGR, ansi->halflen[i]);
+                    p += ansi->halflen[i];
+                    previous[h] = level;
+                }
+            }
+            for (size_t w = 0; w < cwidth; w++) {
+                /* U+2580 UPPER HALF BLOCK */
+                memcpy(p, "\xe2\x96\x80", 3);
+                p += 3;
+            }
+        }
+    }
+    return p;
+}
+
+/* Mark detected touches in reverse video with the color of the cell
+ * below. The whole frame is drawn each time, marks don't need to be
+ * erased. */
+static char *
+hm_ansi_overlay(struct hm_ansi *ansi, struct hm_cfg *cfg,
+                const struct hm_frame *frame, size_t columns, size_t lines,
+                size_t cwidth, size_t cheight, ssize_t offsetx,
+                ssize_t offsety, int sheight, int swidth, char *p)
+{
+    static const char mark[] = "\033[1;7m+\033[22;27m";
+    for (size_t i = 0; i < frame->nblobs; i++) {
+        const struct hm_blob *blob = &frame->blobs[i];
+        if (blob->x < -0.5 || blob->y < -0.5) continue;
+        size_t x = blob->x + 0.5, y = blob->y + 0.5;
+        if (x >= columns || y >= lines) continue;
+        size_t column = offsetx + (size_t)((blob->x + 0.5) * cwidth);
+        size_t line = offsety + (size_t)((blob->y + 0.5) * cheight);
+        if (cfg->halfblock) line /= 2;
+        if (column >= (size_t)swidth || line >= (size_t)sheight) continue;
+        int level = hm_ansi_level(ansi, cfg, frame->data[y * columns + x]);
+        p += sprintf(p, "\033[%zu;%zuH", line + 1, column + 1);
+        memcpy(p, ansi->sgr + level * HM_ANSI_SGR, ansi->sgrlen[level]);
+        p += ansi->sgrlen[level];
+        memcpy(p, mark, sizeof(mark) - 1);
+        p += sizeof(mark) - 1;
+    }
+    return p;
+}
+
+int
+hm_ansi_data(struct hm_ansi *ansi, struct hm_cfg *cfg,
+             const struct hm_frame *frame)
+{
+    int *data = frame->data;
+    size_t len = frame->len;
+    struct winsize ws;
+    size_t columns = cfg->width;   /* Number of columns */
+    size_t lines = len / columns; /* Number of lines */
+    int sheight = 24, swidth = 80; /* Screen height and width */
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+        sheight = ws.ws_row;
+        swidth = ws.ws_col;
+    }
+    if (lines == 0) return 0;
+
+    /* With half blocks, there are two rows per line of the screen */
+    int vheight = cfg->halfblock ? 2 * sheight : sheight;
+
+    /* Compute height and width of one cell */
+    size_t cwidth = swidth / columns;
+    size_t cheight = vheight / lines;
+    if (cwidth == 0) cwidth = 1;
+    if (cheight == 0) cheight = 1;
+
+    /* Manage centering */
+    ssize_t offsetx = ((ssize_t)swidth - (ssize_t)(cwidth * columns)) / 2;
+    ssize_t offsety = ((ssize_t)vheight - (ssize_t)(cheight * lines)) / 2;
+    if (offsetx < 0) offsetx = 0;
+    if (offsety < 0) offsety = 0;
+    if (cfg->halfblock) offsety &= ~(ssize_t)1;
+
+    /* Room for a whole frame: one cursor move per row and, at worst,
+     * two SGR sequences and a multibyte character per cell, then the
+     * marks */
+    bool clear = (ansi->lines != lines || ansi->columns != columns ||
+                  ansi->sheight != sheight || ansi->swidth != swidth);
+    size_t needed = 64 + (size_t)sheight *
+        (16 + columns * (2 * HM_ANSI_SGR + 3 * (cwidth > 12 ? cwidth : 12))) +
+        HM_BLOB_MAX * (64 + HM_ANSI_SGR);
+    if (needed > ansi->allocated) {
+        char *new = realloc(ansi->buf, needed);
+        if (new == NULL) return -1;
+        ansi->buf = new;
+        ansi->allocated = needed;
+    }
+
+    uint64_t start = hm_latency_start();
+    char *p = ansi->buf;
+    if (clear) {
+        memcpy(p, "\033[0m\033[2J", 8);
+        p += 8;
+    }
+    memcpy(p, "\033[H", 3);
+    p += 3;
+
+    uint64_t lutstart = hm_latency_start();
+    hm_ansi_lut(ansi, cfg);
+    hm_latency_end(HM_STAGE_QUANTIZE, lutstart);
+
+    /* Cells that don't fit on screen are not drawn */
+    size_t visible = (swidth - offsetx) / cwidth;
+    if (visible > columns) visible = columns;
+
+    if (cfg->halfblock) {
+        p = hm_ansi_halfblock(ansi, cfg, data, lines, columns, visible,
+                              cwidth, cheight, offsetx, offsety, sheight, p);
+    } else {
+        bool shown = cfg->values && cwidth > 3;
+        for (size_t l = 0; l < lines; l++) {
+            for (size_t j = 0; j < cheight; j++) {
+                int previous = -1;
+                size_t y = offsety + l * cheight + j;
+                if (y >= (size_t)sheight) break;
+                p += sprintf(p, "\033[%zu;%zdH", y + 1, offsetx + 1);
+                for (size_t c = 0; c < visible; c++) {
+                    int value = data[l * columns + c];
+                    int level = hm_ansi_level(ansi, cfg, value);
+                    /* Identical runs share one SGR sequence */
+                    if (level != previous) {
+                        memcpy(p, ansi->sgr + level * HM_ANSI_SGR,
+                               ansi->sgrlen[level]);
+                        p += ansi->sgrlen[level];
+                        previous = level;
+                    }
+                    if (shown && j == cheight / 2) {
+                        p += sprintf(p, "% *d", (int)cwidth, value);
+                    } else {
+                        memset(p, ' ', cwidth);
+                        p += cwidth;
+                    }
+                }
+            }
+        }
+    }
+    p = hm_ansi_overlay(ansi, cfg, frame, columns, lines, cwidth, cheight,
+                        offsetx, offsety, sheight, swidth, p);
+    memcpy(p, "\033[0m", 4);
+    p += 4;
+
+    ansi->lines = lines;
+    ansi->columns = columns;
+    ansi->sheight = sheight;
+    ansi->swidth = swidth;
+    ansi->emitted = p - ansi->buf;
+    hm_latency_end(HM_STAGE_EMIT, start);
+
+    start = hm_latency_start();
+    int ret = hm_ansi_write(ansi->buf, p - ansi->buf);
+    hm_latency_end(HM_STAGE_REFRESH, start);
+    return ret;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+/*
+ * Automatic range from percentiles of the recent values. Values go to a
+ * histogram whose counts decay exponentially with time, so old frames,
+ * and old spikes, fade away. Buckets are log-linear like the latency
+ * histograms, mirrored for negative values. Each frame costs one pass
+ * over its values and two over the buckets.
+ */
+
+/* Fixed point: counts and decay factors have this many fractional bits */
+#define HM_AUTORANGE_FRACTION 16
+
+static inline size_t
+hm_autorange_bucket(int v)
+{
+    if (v >= 0) return HM_AUTORANGE_HALF + hm_loglin_bucket(v);
+    return HM_AUTORANGE_HALF - 1 - hm_loglin_bucket(-(v + 1));
+}
+
+/* Lowest value falling in a bucket */
+static int
+hm_autorange_low(size_t index)
+{
+    if (index >= HM_AUTORANGE_HALF)
+        return hm_loglin_low(index - HM_AUTORANGE_HALF);
+    return -(int64_t)hm_loglin_high(HM_AUTORANGE_HALF - 1 - index) - 1;
+}
+
+/* Highest value falling in a bucket */
+static int
+hm_autorange_high(size_t index)
+{
+    if (index >= HM_AUTORANGE_HALF) {
+        uint64_t high = hm_loglin_high(index - HM_AUTORANGE_HALF);
+        return high > INT_MAX ? INT_MAX : high;
+    }
+    return -(int64_t)hm_loglin_low(HM_AUTORANGE_HALF - 1 - index) - 1;
+}
+
+/* Track percentiles low and high, from 0 to 100, of the values seen in
+ * the last window seconds. Without window, counts never decay. */
+void
+hm_autorange_init(struct hm_autorange *autorange,
+                  double low, double high, double window)
+{
+    memset(autorange, 0, sizeof(*autorange));
+    autorange->low = low;
+    autorange->high = high;
+    autorange->window = window;
+}
+
+/* Forget everything seen so far */
+void
+hm_autorange_reset(struct hm_autorange *autorange)
+{
+    memset(autorange->counts, 0, sizeof(autorange->counts));
+    autorange->total = 0;
+    autorange->last = 0;
+}
+
+/* Use the display range of a frame for automatic bounds */
+void
+hm_autorange_apply(struct hm_cfg *cfg, const struct hm_frame *frame)
+{
+    if (cfg->auto_min) cfg->min = frame->low;
+    if (cfg->auto_max) cfg->max = frame->high;
+}
+
+/* Add a frame and set its display range */
+void
+hm_autorange_update(struct hm_autorange *autorange, struct hm_frame *frame)
+{
+    uint64_t *counts = autorange->counts;
+
+    /* Decay in fixed point, by exp(-dt/window) */
+    if (autorange->window > 0 && autorange->last != 0) {
+        if (frame->timestamp < autorange->last) {
+            /* Going back in time, like when seeking in a capture */
+            hm_autorange_reset(autorange);
+        } else {
+            double dt = (frame->timestamp - autorange->last) / 1e9;
+            uint64_t factor = exp(-dt / autorange->window) *
+                (1 << HM_AUTORANGE_FRACTION);
+            uint64_t total = 0;
+            for (size_t i = 0; i < HM_AUTORANGE_BUCKETS; i++) {
+                counts[i] = (counts[i] * factor) >> HM_AUTORANGE_FRACTION;
+                total += counts[i];
+            }
+            autorange->total = total;
+        }
+    }
+    autorange->last = frame->timestamp;
+
+    for (size_t i = 0; i < frame->len; i++)
+        counts[hm_autorange_bucket(frame->data[i])] += 1 << HM_AUTORANGE_FRACTION;
+    autorange->total += (uint64_t)frame->len << HM_AUTORANGE_FRACTION;
+    if (autorange->total == 0) {
+        frame->low = frame->min;
+        frame->high = frame->max;
+        return;
+    }
+
+    /* Walk the cumulative counts up to both percentiles */
+    uint64_t tlow = autorange->total * autorange->low / 100;
+    uint64_t thigh = autorange->total * autorange->high / 100;
+    uint64_t cumulated = 0;
+    size_t i = 0, ilow = 0, ihigh = HM_AUTORANGE_BUCKETS - 1;
+    for (; i < HM_AUTORANGE_BUCKETS; i++) {
+        cumulated += counts[i];
+        if (cumulated > tlow) {
+            ilow = i;
+            break;
+        }
+    }
+    for (; i < HM_AUTORANGE_BUCKETS; i++) {
+        if (cumulated >= thigh && counts[i] > 0) {
+            ihigh = i;
+            break;
+        }
+        if (i + 1 < HM_AUTORANGE_BUCKETS) cumulated += counts[i + 1];
+    }
+    frame->low = hm_autorange_low(ilow);
+    frame->high = hm_autorange_high(ihigh);
+}
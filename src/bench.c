@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Microbenchmarks of the frame path: acquisition and decoding of a
+ * frame from a file, mapping and drawing with ncurses on a virtual
+ * terminal, and composing frames with the direct renderer. Run with
+ * "make bench".
+ */
+
+#include "heatmap.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+
+/* Minimum time spent on each benchmark, in ns */
+#define BENCH_DURATION (500 * 1000 * 1000ULL)
+
+/* Number of distinct frames cycled through */
+#define BENCH_FRAMES 16
+
+/* Terminal used for rendering benchmarks */
+#define BENCH_LINES 60
+#define BENCH_COLUMNS 200
+
+static const struct {
+    unsigned int width;
+    unsigned int height;
+} sizes[] = {
+    { 19, 11 },
+    { 40, 70 },
+    { 128, 72 },
+    { 256, 144 },
+};
+
+/* A touch moving diagonally over some noise */
+static void
+bench_frame(int16_t *frame, unsigned int width, unsigned int height,
+            unsigned int n)
+{
+    unsigned int cx = n * width / BENCH_FRAMES;
+    unsigned int cy = n * height / BENCH_FRAMES;
+    unsigned int seed = n;
+    for (unsigned int y = 0; y < height; y++)
+        for (unsigned int x = 0; x < width; x++) {
+            int dx = x - cx, dy = y - cy;
+            int d2 = dx * dx + dy * dy;
+            seed = seed * 1103515245 + 12345;
+            frame[y * width + x] = (d2 < 16 ? 800 - 50 * d2 : 0) +
+                (int)((seed >> 16) % 21) - 10;
+        }
+}
+
+static void
+bench_report(const char *name, unsigned int width, unsigned int height,
+             uint64_t elapsed, unsigned long frames, unsigned long bytes,
+             bool emits)
+{
+    char size[32];
+    snprintf(size, sizeof(size), "%ux%u", width, height);
+    if (emits)
+        printf("%-22s %10s %12.1f %12.1f\n", name, size,
+               (double)elapsed / frames, (double)bytes / frames);
+    else
+        printf("%-22s %10s %12.1f %12s\n", name, size,
+               (double)elapsed / frames, "-");
+    fflush(stdout);
+}
+
+/* Acquisition: pread() and decode of a frame from a file on tmpfs */
+static void
+bench_retrieve(unsigned int width, unsigned int height)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/heatmap-bench-XXXXXX",
+             access("/dev/shm", W_OK) == 0 ? "/dev/shm" : (dir ? dir : "/tmp"));
+    int fd = mkstemp(path);
+    if (fd == -1) fatal("bench", "unable to create data file");
+    size_t len = width * height;
+    int16_t *raw = calloc(len, sizeof(int16_t));
+    if (raw == NULL) fatal("bench", NULL);
+    bench_frame(raw, width, height, 0);
+    if (write(fd, raw, len * sizeof(int16_t)) != (ssize_t)(len * sizeof(int16_t)))
+        fatal("bench", "unable to write data file");
+    close(fd);
+
+    struct hm_cfg cfg = {
+        .path = path,
+        .fd = -1,
+        .width = width,
+        .height = height,
+        .min = INT_MAX,
+        .max = INT_MIN,
+        .auto_min = true,
+        .auto_max = true
+    };
+    struct hm_frame frame = { 0 };
+    unsigned long frames = 0;
+    uint64_t start = hm_schedule_now(), elapsed;
+    do {
+        if (hm_retrieve_data(&cfg, &frame) != (ssize_t)len)
+            fatal("bench", "unable to retrieve data");
+        frames++;
+    } while ((elapsed = hm_schedule_now() - start) < BENCH_DURATION);
+    bench_report("retrieve", width, height, elapsed, frames, 0, false);
+
+    hm_retrieve_close(&cfg);
+    hm_frame_free(&frame);
+    unlink(path);
+    free(raw);
+}
+
+/* Decode only, from memory */
+static void
+bench_decode(const struct hm_decoder *decoder,
+             unsigned int width, unsigned int height)
+{
+    size_t len = width * height;
+    unsigned char *raw = calloc(len, sizeof(int32_t));
+    int *data = calloc(len, sizeof(int));
+    if (raw == NULL || data == NULL) fatal("bench", NULL);
+    unsigned int seed = 1;
+    for (size_t i = 0; i < len * sizeof(int32_t); i++) {
+        seed = seed * 1103515245 + 12345;
+        raw[i] = seed >> 16;
+    }
+
+    unsigned long frames = 0;
+    uint64_t start = hm_schedule_now(), elapsed;
+    do {
+        int min, max;
+        decoder->decode(raw, data, len, &min, &max);
+        frames++;
+    } while ((elapsed = hm_schedule_now() - start) < BENCH_DURATION);
+    char name[32];
+    snprintf(name, sizeof(name), "decode %s", decoder->name);
+    bench_report(name, width, height, elapsed, frames, 0, false);
+
+    free(raw);
+    free(data);
+}
+
+/* Decoded frames to draw */
+static int **
+bench_frames(unsigned int width, unsigned int height)
+{
+    size_t len = width * height;
+    int16_t *raw = calloc(len, sizeof(int16_t));
+    int **frames = calloc(BENCH_FRAMES, sizeof(int *));
+    if (raw == NULL || frames == NULL) fatal("bench", NULL);
+    for (unsigned int n = 0; n < BENCH_FRAMES; n++) {
+        int min, max;
+        frames[n] = calloc(len, sizeof(int));
+        if (frames[n] == NULL) fatal("bench", NULL);
+        bench_frame(raw, width, height, n);
+        hm_decode_s16le(raw, frames[n], len, &min, &max);
+    }
+    free(raw);
+    return frames;
+}
+
+static void
+bench_frames_free(int **frames)
+{
+    for (unsigned int n = 0; n < BENCH_FRAMES; n++)
+        free(frames[n]);
+    free(frames);
+}
+
+/* Baseline, median of 5 and moving average, on frames copied in turn */
+static void
+bench_filter(unsigned int width, unsigned int height)
+{
+    size_t len = width * height;
+    int **frames = bench_frames(width, height);
+    struct hm_filter filter;
+    struct hm_frame frame = { 0 };
+    if (hm_filter_init(&filter, 3, 5, true) == -1 ||
+        hm_frame_reserve(&frame, len) == -1)
+        fatal("bench", NULL);
+    frame.len = len;
+
+    unsigned long frames_done = 0;
+    uint64_t start = hm_schedule_now(), elapsed;
+    do {
+        memcpy(frame.data, frames[frames_done % BENCH_FRAMES], len * sizeof(int));
+        frame.timestamp = frames_done;
+        if (hm_filter_apply(&filter, &frame) == -1)
+            fatal("bench", "unable to filter frame");
+        frames_done++;
+    } while ((elapsed = hm_schedule_now() - start) < BENCH_DURATION);
+    bench_report("filter", width, height, elapsed, frames_done, 0, false);
+
+    hm_filter_free(&filter);
+    hm_frame_free(&frame);
+    bench_frames_free(frames);
+}
+
+/* Touch detection on the moving touch */
+static void
+bench_detect(unsigned int width, unsigned int height)
+{
+    size_t len = width * height;
+    int **frames = bench_frames(width, height);
+    struct hm_blobs blobs;
+    struct hm_frame frame = { .len = len };
+    hm_blobs_init(&blobs, 100, NULL);
+
+    unsigned long count = 0;
+    uint64_t start = hm_schedule_now(), elapsed;
+    do {
+        frame.data = frames[count % BENCH_FRAMES];
+        if (hm_blobs_detect(&blobs, width, &frame) == -1)
+            fatal("bench", "unable to detect touches");
+        count++;
+    } while ((elapsed = hm_schedule_now() - start) < BENCH_DURATION);
+    bench_report("detect", width, height, elapsed, count, 0, false);
+
+    hm_blobs_free(&blobs);
+    bench_frames_free(frames);
+}
+
+/* ncurses renderer on a virtual terminal writing to a file. With idle,
+ * the same frame is drawn over and over. */
+static void
+bench_display(unsigned int width, unsigned int height, bool idle)
+{
+    FILE *out = tmpfile();
+    FILE *in = fopen("/dev/null", "r");
+    if (out == NULL || in == NULL) fatal("bench", "unable to open terminal");
+    SCREEN *screen = newterm("xterm-256color", out, in);
+    if (screen == NULL) fatalx("bench", "unable to create terminal");
+    set_term(screen);
+
+    struct hm_cfg cfg = {
+        .width = width,
+        .min = -10,
+        .max = 810
+    };
+    struct hm_display display = { 0 };
+    int **frames = bench_frames(width, height);
+    hm_display_init(&cfg);
+    hm_display_draw(&display, &cfg, frames[0], width * height);
+    refresh();
+    fflush(out);
+    long origin = ftell(out);
+
+    unsigned long count = 0;
+    uint64_t start = hm_schedule_now(), elapsed;
+    do {
+        int *data = frames[idle ? 0 : count % BENCH_FRAMES];
+        if (hm_display_draw(&display, &cfg, data, width * height))
+            refresh();
+        count++;
+    } while ((elapsed = hm_schedule_now() - start) < BENCH_DURATION);
+    fflush(out);
+    bench_report(idle ? "display (idle)" : "display", width, height,
+                 elapsed, count, ftell(out) - origin, true);
+
+    hm_display_free(&display);
+    bench_frames_free(frames);
+    endwin();
+    delscreen(screen);
+    fclose(out);
+    fclose(in);
+}
+
+/* Direct renderer, with its output sent to /dev/null */
+static void
+bench_ansi(unsigned int width, unsigned int height, bool halfblock)
+{
+    int null = open("/dev/null", O_WRONLY);
+    int saved = dup(STDOUT_FILENO);
+    if (null == -1 || saved == -1) fatal("bench", "unable to redirect output");
+    dup2(null, STDOUT_FILENO);
+
+    struct hm_cfg cfg = {
+        .width = width,
+        .min = -10,
+        .max = 810,
+        .halfblock = halfblock
+    };
+    struct hm_ansi ansi;
+    int **frames = bench_frames(width, height);
+    if (hm_ansi_init(&ansi, &cfg) == -1) fatal("bench", "unable to setup renderer");
+
+    unsigned long count = 0, bytes = 0;
+    uint64_t start = hm_schedule_now(), elapsed;
+    do {
+        struct hm_frame frame = {
+            .data = frames[count % BENCH_FRAMES],
+            .len = width * height
+        };
+        hm_ansi_data(&ansi, &cfg, &frame);
+        bytes += ansi.emitted;
+        count++;
+    } while ((elapsed = hm_schedule_now() - start) < BENCH_DURATION);
+
+    hm_ansi_free(&ansi);
+    bench_frames_free(frames);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+    bench_report(halfblock ? "ansi (halfblock)" : "ansi", width, height,
+                 elapsed, count, bytes, true);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char lines[16], columns[16];
+
+    log_init(1, "heatmap-bench");
+
+    /* Size of the virtual terminals */
+    snprintf(lines, sizeof(lines), "%d", BENCH_LINES);
+    snprintf(columns, sizeof(columns), "%d", BENCH_COLUMNS);
+    setenv("LINES", lines, 1);
+    setenv("COLUMNS", columns, 1);
+
+    printf("%-22s %10s %12s %12s\n", "benchmark", "size", "ns/frame", "bytes/frame");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        unsigned int width = sizes[i].width, height = sizes[i].height;
+        bench_retrieve(width, height);
+        bench_decode(hm_decoder_lookup(NULL), width, height);
+        bench_filter(width, height);
+        bench_detect(width, height);
+        bench_display(width, height, false);
+        bench_display(width, height, true);
+        bench_ansi(width, height, false);
+        bench_ansi(width, height, true);
+    }
+
+    /* Other formats, on the largest panel */
+    size_t last = sizeof(sizes) / sizeof(sizes[0]) - 1;
+    for (const struct hm_decoder *decoder = hm_decoder_list();
+         decoder->name; decoder++)
+        bench_decode(decoder, sizes[last].width, sizes[last].height);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+
+/*
+ * Detection of touches: cells at or above a threshold are grouped in
+ * 4-connected components with a single raster pass. Each cell takes the
+ * label of its left or upper neighbour, or a new one, and labels found
+ * to be connected are merged with union-find. Statistics are
+ * accumulated per label during the pass and folded into the roots at
+ * the end, so only two rows of labels are kept. Buffers are allocated
+ * once per geometry.
+ */
+
+/* Statistics of a provisional label */
+struct hm_blob_acc {
+    uint32_t parent;		/* Union-find parent, itself for a root */
+    int area;
+    int peak;
+    int64_t weight;		/* Sum of values above threshold */
+    int64_t wx;			/* Sums of weighted positions */
+    int64_t wy;
+};
+
+void
+hm_blobs_init(struct hm_blobs *blobs, int threshold, FILE *log)
+{
+    memset(blobs, 0, sizeof(*blobs));
+    blobs->threshold = threshold;
+    blobs->log = log;
+}
+
+/* The same settings, with state of its own. Logged blobs are prefixed
+ * with label. */
+void
+hm_blobs_copy(struct hm_blobs *blobs, const struct hm_blobs *from,
+              const char *label)
+{
+    hm_blobs_init(blobs, from->threshold, from->log);
+    blobs->label = label;
+}
+
+void
+hm_blobs_free(struct hm_blobs *blobs)
+{
+    free(blobs->rows);
+    free(blobs->acc);
+    blobs->rows = NULL;
+    blobs->acc = NULL;
+    blobs->width = blobs->len = 0;
+}
+
+/* Label rows are the previous, the current and an empty one. There is
+ * at most one new label per cell. */
+static int
+hm_blobs_setup(struct hm_blobs *blobs, size_t width, size_t len)
+{
+    hm_blobs_free(blobs);
+    blobs->rows = calloc(3 * width, sizeof(uint32_t));
+    blobs->acc = calloc(len + 1, sizeof(struct hm_blob_acc));
+    if (blobs->rows == NULL || blobs->acc == NULL) {
+        hm_blobs_free(blobs);
+        return -1;
+    }
+    blobs->width = width;
+    blobs->len = len;
+    return 0;
+}
+
+static inline uint32_t
+hm_blobs_find(struct hm_blob_acc *acc, uint32_t label)
+{
+    while (acc[label].parent != label) {
+        /* Path halving */
+        acc[label].parent = acc[acc[label].parent].parent;
+        label = acc[label].parent;
+    }
+    return label;
+}
+
+/* Merge two labels, the smallest root wins */
+static inline uint32_t
+hm_blobs_union(struct hm_blob_acc *acc, uint32_t a, uint32_t b)
+{
+    a = hm_blobs_find(acc, a);
+    b = hm_blobs_find(acc, b);
+    if (a < b) acc[b].parent = a;
+    else if (b < a) acc[a].parent = b;
+    return a < b ? a : b;
+}
+
+/* Keep a blob, replacing the lightest one when full */
+static void
+hm_blobs_keep(struct hm_frame *frame, const struct hm_blob_acc *acc)
+{
+    struct hm_blob blob = {
+        .x = (double)acc->wx / acc->weight,
+        .y = (double)acc->wy / acc->weight,
+        .area = acc->area,
+        .peak = acc->peak,
+        .weight = acc->weight
+    };
+    if (frame->nblobs < HM_BLOB_MAX) {
+        frame->blobs[frame->nblobs++] = blob;
+        return;
+    }
+    size_t lightest = 0;
+    for (size_t i = 1; i < HM_BLOB_MAX; i++)
+        if (frame->blobs[i].weight < frame->blobs[lightest].weight)
+            lightest = i;
+    if (frame->blobs[lightest].weight < blob.weight)
+        frame->blobs[lightest] = blob;
+}
+
+static void
+hm_blobs_log(struct hm_blobs *blobs, const struct hm_frame *frame)
+{
+    for (size_t i = 0; i < frame->nblobs; i++) {
+        const struct hm_blob *blob = &frame->blobs[i];
+        fprintf(blobs->log, "%" PRIu64 ".%06" PRIu64 " %s%s%zu %.2f %.2f %d %d\n",
+                frame->timestamp / 1000000000, frame->timestamp / 1000 % 1000000,
+                blobs->label ? blobs->label : "", blobs->label ? " " : "",
+                i, blob->x, blob->y, blob->area, blob->peak);
+    }
+}
+
+/* Find the blobs of a frame of the given width */
+int
+hm_blobs_detect(struct hm_blobs *blobs, size_t width, struct hm_frame *frame)
+{
+    size_t len = frame->len;
+    frame->nblobs = 0;
+    if (width == 0 || len < width) return 0;
+    len -= len % width;
+    if ((width != blobs->width || len != blobs->len) &&
+        hm_blobs_setup(blobs, width, len) == -1)
+        return -1;
+
+    struct hm_blob_acc *acc = blobs->acc;
+    uint32_t *none = blobs->rows + 2 * width;
+    uint32_t *row = blobs->rows, *up = none;
+    uint32_t labels = 0;
+    int threshold = blobs->threshold;
+    const int *data = frame->data;
+
+    for (size_t y = 0; y < len / width; y++, data += width) {
+        /* Most rows have no touch */
+        int peak = INT_MIN;
+        for (size_t x = 0; x < width; x++)
+            peak = data[x] > peak ? data[x] : peak;
+        if (peak < threshold) {
+            up = none;
+            continue;
+        }
+
+        uint32_t left = 0;
+        for (size_t x = 0; x < width; x++) {
+            int value = data[x];
+            if (value < threshold) {
+                row[x] = left = 0;
+                continue;
+            }
+            uint32_t label;
+            if (left && up[x])
+                label = (left == up[x]) ? left : hm_blobs_union(acc, left, up[x]);
+            else if (left || up[x])
+                label = left | up[x];
+            else {
+                label = ++labels;
+                acc[label] = (struct hm_blob_acc){ .parent = label, .peak = INT_MIN };
+            }
+            int64_t weight = (int64_t)value - threshold + 1;
+            struct hm_blob_acc *a = &acc[label];
+            a->area++;
+            if (value > a->peak) a->peak = value;
+            a->weight += weight;
+            a->wx += weight * x;
+            a->wy += weight * y;
+            row[x] = left = label;
+        }
+        up = row;
+        row = (row == blobs->rows) ? blobs->rows + width : blobs->rows;
+    }
+
+    /* Fold the statistics of each label into its root */
+    for (uint32_t l = 1; l <= labels; l++) {
+        uint32_t root = hm_blobs_find(acc, l);
+        if (root == l) continue;
+        struct hm_blob_acc *r = &acc[root], *a = &acc[l];
+        r->area += a->area;
+        if (a->peak > r->peak) r->peak = a->peak;
+        r->weight += a->weight;
+        r->wx += a->wx;
+        r->wy += a->wy;
+    }
+    for (uint32_t l = 1; l <= labels; l++)
+        if (acc[l].parent == l) hm_blobs_keep(frame, &acc[l]);
+
+    if (blobs->log) hm_blobs_log(blobs, frame);
+    return 0;
+}
@@ -24,7 +24,6 @@
 #include <dirent.h>
 #include <sys/types.h>
 
-#define DEBUGFS_ROOT_DIR		"/sys/kernel/debug"
 #define HEATMAP_DIR_PREFIX		"heatmap-"
 
 #define DEBUGFS_NAME_LEN		50
@@ -65,9 +64,15 @@ file_get_contents(char *dirname, char *filename, char *buf, unsigned int count)
     snprintf(path, DEBUGFS_PATH_LEN, "%s/%s", dirname, filename);
 
     fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open <%s>\n", path);
+        return NULL;
+    }
     ret = fgets(buf, count, fp);
     if (!ret)
         fprintf(stderr, "Unable to read contents from <%s>\n", path);
+    else
+        buf[strcspn(buf, "\n")] = '\0';
 
     fclose(fp);
 
@@ -88,7 +93,13 @@ debugfs_scan_config(struct hm_cfg cfgs[], int *idx, char *dirname)
         if (strchr(ep->d_name, '.'))
             continue;
 
-        sprintf(tmp, "%s/%s", dirname, ep->d_name);
+        if (*idx >= MAX_DEBUGFS_CONFIGS)
+            break;
+
+        /* leave room for the data file */
+        int len = snprintf(tmp, sizeof(tmp), "%s/%s", dirname, ep->d_name);
+        if (len < 0 || (size_t)len >= sizeof(tmp) - strlen("/data"))
+            continue;
         sub_dp = opendir(tmp);
         if (!sub_dp)
             continue;
@@ -112,8 +123,9 @@ debugfs_scan_config(struct hm_cfg cfgs[], int *idx, char *dirname)
 
         file_get_contents(tmp, "format", cfg->format, DEBUGFS_FORMAT_LEN);
 
-        /* set path */
-        snprintf(cfg->path, DEBUGFS_PATH_LEN, "%s/%s", tmp, "data");
+        /* set path, room for it was checked above */
+        strcpy(cfg->path, tmp);
+        strcat(cfg->path, "/data");
 
         closedir(sub_dp);
 
@@ -138,20 +150,24 @@ free_debugfs_config(struct hm_cfg *cfg)
 }
 
 int
-debugfs_get_config(struct hm_cfg cfgs[])
+debugfs_get_config(const char *root, struct hm_cfg cfgs[])
 {
     int i = 0;
     char path[DEBUGFS_PATH_LEN];
     DIR *dp;
     struct dirent *ep;
 
-    dp = opendir(DEBUGFS_ROOT_DIR);
+    dp = opendir(root);
     if (dp) {
         while ((ep = readdir(dp))) {
             if (!strncmp(ep->d_name, HEATMAP_DIR_PREFIX, strlen(HEATMAP_DIR_PREFIX))) {
 
                 /* configure base dir */
-                snprintf(path, DEBUGFS_PATH_LEN, "%s/%s", DEBUGFS_ROOT_DIR, ep->d_name);
+                if (snprintf(path, DEBUGFS_PATH_LEN, "%s/%s", root,
+                             ep->d_name) >= DEBUGFS_PATH_LEN) {
+                    fprintf(stderr, "Path too long under <%s>\n", root);
+                    continue;
+                }
 
                 debugfs_scan_config(cfgs, &i, path);
 
@@ -24,24 +24,45 @@
 
 #define MAX_DEBUGFS_CONFIGS		10
 
+struct hm_decoder;
+struct hm_stream;
+struct hm_autorange;
+struct hm_filter;
+struct hm_blobs;
+struct hm_input;
+struct hm_dedup;
+struct hm_stats;
+
 struct hm_cfg {
     char *name;		/* Data type name */
     char *input_name;	/* Input device name */
     char *path;		/* Path to data file */
     char *format;		/* Data format */
+    const struct hm_decoder *decoder; /* Decoder for format, NULL until known */
+    int fd;			/* Opened data file or -1 */
+    bool sequential;		/* Data file is not a regular file */
+    struct hm_stream *stream;	/* Stream to read frames from or NULL */
     unsigned int rate;	/* Refresh rate */
+    bool catchup;		/* Catch up on missed refreshes */
     unsigned int width;	/* Touchscreen width */
     unsigned int height;	/* Touchscreen height */
     int min;		/* Minimal pressure value */
     int max;		/* Maximumal pressure value */
     bool auto_min;
     bool auto_max;
+    struct hm_autorange *autorange; /* Automatic bounds state or NULL */
+    struct hm_filter *filter;	/* Processing of decoded values or NULL */
+    struct hm_blobs *blobs;	/* Touch detection state or NULL */
+    struct hm_stats *stats;	/* Statistics shown instead of values or NULL */
+    struct hm_input *input;	/* Input device gating acquisition or NULL */
+    struct hm_dedup *dedup;	/* Skipping of repeated frames or NULL */
     bool values;		/* Display pressure values */
     bool gray;		/* Use grayscale */
+    bool halfblock;		/* Two rows per line with half blocks */
 };
 
 /* debugfs */
-int debugfs_get_config(struct hm_cfg cfgs[]);
+int debugfs_get_config(const char *root, struct hm_cfg cfgs[]);
 void print_debugfs_devices(struct hm_cfg cfg[], unsigned int count);
 void free_debugfs_configs(struct hm_cfg cfgs[], unsigned int count);
 #endif
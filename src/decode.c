@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <inttypes.h>
+#include <limits.h>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#  define HM_DECODE_X86
+#  include <immintrin.h>
+#endif
+
+#include <ctype.h>
+#include <string.h>
+
+/*
+ * Decode raw values into ints and compute the minimum and maximum of
+ * the frame in the same pass. Each format gets its own kernel, picked
+ * once from the format name. The SIMD variants of the 16-bit
+ * little-endian kernel must give the exact same results as the scalar
+ * one.
+ */
+
+static inline int
+hm_load_s8(const unsigned char *p)
+{
+    return (int8_t)p[0];
+}
+
+static inline int
+hm_load_u8(const unsigned char *p)
+{
+    return p[0];
+}
+
+static inline int
+hm_load_s16le(const unsigned char *p)
+{
+    return (int16_t)(p[0] | (p[1] << 8));
+}
+
+static inline int
+hm_load_s16be(const unsigned char *p)
+{
+    return (int16_t)((p[0] << 8) | p[1]);
+}
+
+static inline int
+hm_load_u16le(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline int
+hm_load_u16be(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline int
+hm_load_s32le(const unsigned char *p)
+{
+    return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                     ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static inline int
+hm_load_s32be(const unsigned char *p)
+{
+    return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                     ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+/* Unsigned 32-bit values above INT_MAX are clamped, without branches */
+static inline int
+hm_load_u32le(const unsigned char *p)
+{
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return (v | -(v >> 31)) & INT_MAX;
+}
+
+static inline int
+hm_load_u32be(const unsigned char *p)
+{
+    uint32_t v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    return (v | -(v >> 31)) & INT_MAX;
+}
+
+#define HM_MINMAX(v) do {                       \
+        lmin = (v) < lmin ? (v) : lmin;         \
+        lmax = (v) > lmax ? (v) : lmax;         \
+    } while (0)
+
+/* Kernel for values of size bytes, unrolled four times */
+#define HM_DECODE_KERNEL(name, size, load)                              \
+static void                                                             \
+hm_decode_##name(const void *buf, int *data, size_t len,                \
+                 int *min, int *max)                                    \
+{                                                                       \
+    const unsigned char *raw = buf;                                     \
+    int lmin = INT_MAX, lmax = INT_MIN;                                 \
+    size_t i = 0;                                                       \
+    for (; i + 4 <= len; i += 4) {                                      \
+        const unsigned char *p = raw + i * (size);                      \
+        int v0 = load(p);                                               \
+        int v1 = load(p + (size));                                      \
+        int v2 = load(p + 2 * (size));                                  \
+        int v3 = load(p + 3 * (size));                                  \
+        data[i] = v0;                                                   \
+        data[i + 1] = v1;                                               \
+        data[i + 2] = v2;                                               \
+        data[i + 3] = v3;                                               \
+        HM_MINMAX(v0);                                                  \
+        HM_MINMAX(v1);                                                  \
+        HM_MINMAX(v2);                                                  \
+        HM_MINMAX(v3);                                                  \
+    }                                                                   \
+    for (; i < len; i++) {                                              \
+        int v = load(raw + i * (size));                                 \
+        data[i] = v;                                                    \
+        HM_MINMAX(v);                                                   \
+    }                                                                   \
+    *min = lmin;                                                        \
+    *max = lmax;                                                        \
+}
+
+HM_DECODE_KERNEL(s8, 1, hm_load_s8)
+HM_DECODE_KERNEL(u8, 1, hm_load_u8)
+HM_DECODE_KERNEL(s16le_scalar, 2, hm_load_s16le)
+HM_DECODE_KERNEL(s16be, 2, hm_load_s16be)
+HM_DECODE_KERNEL(u16le, 2, hm_load_u16le)
+HM_DECODE_KERNEL(u16be, 2, hm_load_u16be)
+HM_DECODE_KERNEL(s32le, 4, hm_load_s32le)
+HM_DECODE_KERNEL(s32be, 4, hm_load_s32be)
+HM_DECODE_KERNEL(u32le, 4, hm_load_u32le)
+HM_DECODE_KERNEL(u32be, 4, hm_load_u32be)
+
+/* Packed 12-bit values: two values in three bytes, as a little-endian
+ * 24-bit word with the first value in the low bits. An odd last value
+ * is stored in the low bits of two bytes. */
+#define HM_DECODE_PACKED12(name, sign)                                  \
+static void                                                             \
+hm_decode_##name(const void *buf, int *data, size_t len,                \
+                 int *min, int *max)                                    \
+{                                                                       \
+    const unsigned char *raw = buf;                                     \
+    int lmin = INT_MAX, lmax = INT_MIN;                                 \
+    size_t i = 0;                                                       \
+    for (; i + 2 <= len; i += 2) {                                      \
+        const unsigned char *p = raw + i / 2 * 3;                       \
+        uint32_t w = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);       \
+        int v0 = w & 0xfff;                                             \
+        int v1 = w >> 12;                                               \
+        if (sign) {                                                     \
+            v0 = (v0 ^ 0x800) - 0x800;                                  \
+            v1 = (v1 ^ 0x800) - 0x800;                                  \
+        }                                                               \
+        data[i] = v0;                                                   \
+        data[i + 1] = v1;                                               \
+        HM_MINMAX(v0);                                                  \
+        HM_MINMAX(v1);                                                  \
+    }                                                                   \
+    if (i < len) {                                                      \
+        const unsigned char *p = raw + i / 2 * 3;                       \
+        int v = (p[0] | (p[1] << 8)) & 0xfff;                           \
+        if (sign) v = (v ^ 0x800) - 0x800;                              \
+        data[i] = v;                                                    \
+        HM_MINMAX(v);                                                   \
+    }                                                                   \
+    *min = lmin;                                                        \
+    *max = lmax;                                                        \
+}
+
+HM_DECODE_PACKED12(s12p, true)
+HM_DECODE_PACKED12(u12p, false)
+
+#ifdef HM_DECODE_X86
+
+/* Horizontal reductions of 8 x int16 */
+__attribute__((target("sse2")))
+static inline int
+hm_hmin_epi16(__m128i v)
+{
+    v = _mm_min_epi16(v, _mm_shuffle_epi32(v, 0x4e));
+    v = _mm_min_epi16(v, _mm_shuffle_epi32(v, 0xb1));
+    v = _mm_min_epi16(v, _mm_shufflelo_epi16(v, 0xb1));
+    return (int16_t)_mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2")))
+static inline int
+hm_hmax_epi16(__m128i v)
+{
+    v = _mm_max_epi16(v, _mm_shuffle_epi32(v, 0x4e));
+    v = _mm_max_epi16(v, _mm_shuffle_epi32(v, 0xb1));
+    v = _mm_max_epi16(v, _mm_shufflelo_epi16(v, 0xb1));
+    return (int16_t)_mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2")))
+static void
+hm_decode_s16le_sse2(const void *buf, int *data, size_t len,
+                     int *min, int *max)
+{
+    const unsigned char *raw = buf;
+    __m128i vmin = _mm_set1_epi16(INT16_MAX);
+    __m128i vmax = _mm_set1_epi16(INT16_MIN);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(raw + 2*i));
+        vmin = _mm_min_epi16(vmin, v);
+        vmax = _mm_max_epi16(vmax, v);
+        /* Sign extension: put each value in the upper half, then shift */
+        _mm_storeu_si128((__m128i *)(data + i),
+                         _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        _mm_storeu_si128((__m128i *)(data + i + 4),
+                         _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+    }
+    int tmin, tmax;
+    hm_decode_s16le_scalar(raw + 2*i, data + i, len - i, &tmin, &tmax);
+    *min = (i > 0 && hm_hmin_epi16(vmin) < tmin) ? hm_hmin_epi16(vmin) : tmin;
+    *max = (i > 0 && hm_hmax_epi16(vmax) > tmax) ? hm_hmax_epi16(vmax) : tmax;
+}
+
+__attribute__((target("avx2")))
+static void
+hm_decode_s16le_avx2(const void *buf, int *data, size_t len,
+                     int *min, int *max)
+{
+    const unsigned char *raw = buf;
+    __m256i vmin = _mm256_set1_epi16(INT16_MAX);
+    __m256i vmax = _mm256_set1_epi16(INT16_MIN);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(raw + 2*i));
+        vmin = _mm256_min_epi16(vmin, v);
+        vmax = _mm256_max_epi16(vmax, v);
+        _mm256_storeu_si256((__m256i *)(data + i),
+                            _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)));
+        _mm256_storeu_si256((__m256i *)(data + i + 8),
+                            _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1)));
+    }
+    int tmin, tmax;
+    hm_decode_s16le_sse2(raw + 2*i, data + i, len - i, &tmin, &tmax);
+    if (i > 0) {
+        int m;
+        m = hm_hmin_epi16(_mm_min_epi16(_mm256_castsi256_si128(vmin),
+                                        _mm256_extracti128_si256(vmin, 1)));
+        if (m < tmin) tmin = m;
+        m = hm_hmax_epi16(_mm_max_epi16(_mm256_castsi256_si128(vmax),
+                                        _mm256_extracti128_si256(vmax, 1)));
+        if (m > tmax) tmax = m;
+    }
+    *min = tmin;
+    *max = tmax;
+}
+
+#endif
+
+static void hm_decode_s16le_resolve(const void *, int *, size_t,
+                                    int *, int *);
+static hm_decode_fn hm_decode_s16le_impl = hm_decode_s16le_resolve;
+
+/* Pick the best implementation for this CPU on first use */
+static void
+hm_decode_s16le_resolve(const void *raw, int *data, size_t len,
+                        int *min, int *max)
+{
+    const char *name = "scalar";
+    hm_decode_fn fn = hm_decode_s16le_scalar;
+#ifdef HM_DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        name = "avx2";
+        fn = hm_decode_s16le_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        name = "sse2";
+        fn = hm_decode_s16le_sse2;
+    }
+#endif
+    log_debug("decode", "using %s decoder", name);
+    hm_decode_s16le_impl = fn;
+    fn(raw, data, len, min, max);
+}
+
+void
+hm_decode_s16le(const void *raw, int *data, size_t len, int *min, int *max)
+{
+    hm_decode_s16le_impl(raw, data, len, min, max);
+}
+
+static const struct hm_decoder decoders[] = {
+    { "s8",    1, 1, hm_decode_s8 },
+    { "u8",    1, 1, hm_decode_u8 },
+    { "s16le", 2, 1, hm_decode_s16le },
+    { "s16be", 2, 1, hm_decode_s16be },
+    { "u16le", 2, 1, hm_decode_u16le },
+    { "u16be", 2, 1, hm_decode_u16be },
+    { "s32le", 4, 1, hm_decode_s32le },
+    { "s32be", 4, 1, hm_decode_s32be },
+    { "u32le", 4, 1, hm_decode_u32le },
+    { "u32be", 4, 1, hm_decode_u32be },
+    { "s12p",  3, 2, hm_decode_s12p },
+    { "u12p",  3, 2, hm_decode_u12p },
+    { NULL }
+};
+
+/* Decoder for a format name. No format means 16-bit little-endian
+ * signed values. Trailing spaces are ignored. */
+const struct hm_decoder *
+hm_decoder_lookup(const char *format)
+{
+    if (format == NULL) return &decoders[2];
+    size_t len = strlen(format);
+    while (len > 0 && isspace((unsigned char)format[len - 1])) len--;
+    if (len == 0) return &decoders[2];
+    for (const struct hm_decoder *d = decoders; d->name; d++)
+        if (strlen(d->name) == len && !strncmp(d->name, format, len))
+            return d;
+    return NULL;
+}
+
+/* All decoders, terminated by an entry without name */
+const struct hm_decoder *
+hm_decoder_list(void)
+{
+    return decoders;
+}
+
+/* Number of values in size bytes or -1 if size doesn't hold a whole
+ * number of values */
+ssize_t
+hm_decoder_count(const struct hm_decoder *decoder, size_t size)
+{
+    size_t groups = size / decoder->unit;
+    size_t rest = size % decoder->unit;
+    if (rest == 0) return groups * decoder->samples;
+    /* Packed values: an odd last value uses two bytes */
+    if (decoder->samples == 2 && rest == 2) return groups * 2 + 1;
+    return -1;
+}
+
+/* Size in bytes of len values */
+size_t
+hm_decoder_size(const struct hm_decoder *decoder, size_t len)
+{
+    size_t size = len / decoder->samples * decoder->unit;
+    if (len % decoder->samples) size += 2;
+    return size;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <string.h>
+
+/*
+ * Skipping of repeated frames. Controllers often return the same buffer
+ * when the firmware has not refreshed it yet. The raw content of each
+ * frame is hashed right after it is read and a frame hashing like the
+ * previous one is not processed nor displayed. While frames keep
+ * repeating, polls can be skipped, twice as many after each repeat.
+ */
+
+#define NSEC_PER_SEC (1000 * 1000 * 1000ULL)
+
+/* XXH64 primes */
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+hm_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+hm_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+hm_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+hm_round(uint64_t acc, uint64_t input)
+{
+    return hm_rotl(acc + input * P2, 31) * P1;
+}
+
+static inline uint64_t
+hm_merge(uint64_t h, uint64_t v)
+{
+    return (h ^ hm_round(0, v)) * P1 + P4;
+}
+
+/* XXH64 with a null seed, in native byte order. Four independent lanes
+ * keep the multipliers busy on large frames. */
+uint64_t
+hm_dedup_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = -P1;
+        do {
+            v1 = hm_round(v1, hm_read64(p));
+            v2 = hm_round(v2, hm_read64(p + 8));
+            v3 = hm_round(v3, hm_read64(p + 16));
+            v4 = hm_round(v4, hm_read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = hm_rotl(v1, 1) + hm_rotl(v2, 7) + hm_rotl(v3, 12) + hm_rotl(v4, 18);
+        h = hm_merge(h, v1);
+        h = hm_merge(h, v2);
+        h = hm_merge(h, v3);
+        h = hm_merge(h, v4);
+    } else
+        h = P5;
+    h += len;
+
+    for (; end - p >= 8; p += 8)
+        h = hm_rotl(h ^ hm_round(0, hm_read64(p)), 27) * P1 + P4;
+    if (end - p >= 4) {
+        h = hm_rotl(h ^ (hm_read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = hm_rotl(h ^ (*p * P5), 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Read at most once every backoff polls while frames repeat, 1 to
+ * never skip a poll */
+void
+hm_dedup_init(struct hm_dedup *dedup, unsigned int backoff)
+{
+    memset(dedup, 0, sizeof(*dedup));
+    dedup->backoff = backoff ? backoff : 1;
+    dedup->interval = 1;
+}
+
+/* Whether this poll should be skipped without reading anything */
+bool
+hm_dedup_skip(struct hm_dedup *dedup)
+{
+    if (dedup->pending == 0) return false;
+    dedup->pending--;
+    dedup->skipped++;
+    return true;
+}
+
+/* Whether a raw frame is the same as the previous one. Polls are only
+ * skipped when polled, that is when the same file is read again for
+ * each frame. */
+bool
+hm_dedup_check(struct hm_dedup *dedup, const void *raw, size_t len,
+               bool polled)
+{
+    uint64_t hash = hm_dedup_hash(raw, len);
+    uint64_t now = hm_schedule_now();
+    bool repeated = (len == dedup->rawlen && hash == dedup->hash);
+
+    if (dedup->frames++ == 0)
+        dedup->start = dedup->window = now;
+    if (repeated) {
+        dedup->interval *= 2;
+        if (dedup->interval > dedup->backoff)
+            dedup->interval = dedup->backoff;
+        if (polled) dedup->pending = dedup->interval - 1;
+    } else {
+        dedup->hash = hash;
+        dedup->rawlen = len;
+        dedup->interval = 1;
+        dedup->unique++;
+        dedup->windowed++;
+    }
+
+    if (now - dedup->window >= NSEC_PER_SEC) {
+        log_debug("dedup", "%.1f unique frames per second",
+                  dedup->windowed * (double)NSEC_PER_SEC / (now - dedup->window));
+        dedup->window = now;
+        dedup->windowed = 0;
+    }
+    return repeated;
+}
+
+/* Unique frames per second since the first frame */
+double
+hm_dedup_rate(const struct hm_dedup *dedup)
+{
+    uint64_t elapsed = hm_schedule_now() - dedup->start;
+    if (dedup->frames == 0 || elapsed == 0) return 0;
+    return dedup->unique * (double)NSEC_PER_SEC / elapsed;
+}
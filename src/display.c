@@ -18,14 +18,46 @@
 
 #include "heatmap.h"
 
+#include <inttypes.h>
+#include <string.h>
+
 #define MAXGRAY 24
 #define MAXCOLOR 216
 
-struct color {
-    short red;
-    short green;
-    short blue;
-};
+/* Largest range for which a lookup table is used */
+#define MAXLUT 65536
+
+/* Color of level i out of n of the colormap, components from 0 to 1000
+ * like init_color(). The grayscale matches the xterm gray ramp. */
+void
+hm_display_color(bool gray, int i, int n, struct hm_color *color)
+{
+    if (gray) {
+        short level = (8 + 230 * i / (n > 1 ? n - 1 : 1)) * 1000 / 255;
+        color->red = color->green = color->blue = level;
+        return;
+    }
+
+    static const struct hm_color colors[] = {
+        {0,    0,    1000},
+        {0,    1000, 1000},
+        {0,    1000, 0},
+        {1000, 1000, 0},
+        {1000, 0,    0}
+    };
+    int k = 1 + 4 * i / n;
+    int j = i - (k - 1) * n / 4;
+    if (k > 4) k = 4;
+    color->red = 4 * j * (colors[k].red - colors[k-1].red) / n + colors[k-1].red;
+    color->green = 4 * j * (colors[k].green - colors[k-1].green) / n + colors[k-1].green;
+    color->blue = 4 * j * (colors[k].blue - colors[k-1].blue) / n + colors[k-1].blue;
+    if (color->red < 0) color->red = 0;
+    else if (color->red > 1000) color->red = 1000;
+    if (color->green < 0) color->green = 0;
+    else if (color->green > 1000) color->green = 1000;
+    if (color->blue < 0) color->blue = 0;
+    else if (color->blue > 1000) color->blue = 1000;
+}
 
 void
 hm_display_init(struct hm_cfg *cfg)
@@ -48,51 +80,121 @@ hm_display_init(struct hm_cfg *cfg)
     } else {
         init_color(0, 0, 0, 0);
         for (size_t i = 0; i < MAXCOLOR; i++) {
-            struct color colors[] = {
-                {0,    0,    1000},
-                {0,    1000, 1000},
-                {0,    1000, 0},
-                {1000, 1000, 0},
-                {1000, 0,    0}
-            };
-            struct color color;
-            size_t j, k;
-            if (i < MAXCOLOR/4) {
-                j = i;
-                k = 1;
-            } else if (i < MAXCOLOR/2) {
-                j = i - MAXCOLOR/4;
-                k = 2;
-            } else if (i < MAXCOLOR*3/4) {
-                j = i - MAXCOLOR/2;
-                k = 3;
-            } else {
-                j = i - MAXCOLOR*3/4;
-                k = 4;
-            }
-            color.red = 4 * j * (colors[k].red - colors[k-1].red) / MAXCOLOR + colors[k-1].red;
-            color.green = 4 * j * (colors[k].green - colors[k-1].green) / MAXCOLOR + colors[k-1].green;
-            color.blue = 4 * j * (colors[k].blue - colors[k-1].blue) / MAXCOLOR + colors[k-1].blue;
-            if (color.red < 0) color.red = 0;
-            else if (color.red > 1000) color.red = 1000;
-            if (color.green < 0) color.green = 0;
-            else if (color.green > 1000) color.green = 1000;
-            if (color.blue < 0) color.blue = 0;
-            else if (color.blue > 1000) color.blue = 1000;
-
+            struct hm_color color;
+            hm_display_color(false, i, MAXCOLOR, &color);
             init_color(i+16, color.red, color.green, color.blue);
             init_pair(i, 0, i+16);
         }
     }
 }
 
+/* Map a value in [min, max] to one of n levels. A flat range maps
+ * everything to the first level. */
+short
+hm_display_level(int min, int max, int n, int value)
+{
+    if (max <= min) return 0;
+    int64_t q = ((int64_t)value - min) * n / ((int64_t)max - min);
+    if (q >= n) q = n - 1;
+    if (q < 0) q = 0;
+    return q;
+}
+
+/* Map a value in [min, max] to one of the available color pairs */
+static short
+hm_display_quantize(int min, int max, bool gray, int value)
+{
+    return hm_display_level(min, max, gray ? MAXGRAY : MAXCOLOR, value);
+}
+
+/* Rebuild the lookup table if the range or the color mode changed */
+static void
+hm_display_lut(struct hm_display *display, struct hm_cfg *cfg)
+{
+    struct hm_display_lut *lut = &display->lut;
+    if (lut->valid && lut->min == cfg->min && lut->max == cfg->max &&
+        lut->gray == cfg->gray)
+        return;
+
+    lut->valid = true;
+    lut->min = cfg->min;
+    lut->max = cfg->max;
+    lut->gray = cfg->gray;
+    lut->len = 0;
+
+    int64_t len = (cfg->max > cfg->min) ?
+        (int64_t)cfg->max - cfg->min + 1 : 1;
+    if (len > MAXLUT) return;
+    if ((size_t)len > lut->allocated) {
+        short *pairs = realloc(lut->pairs, len * sizeof(short));
+        if (pairs == NULL) return;
+        lut->pairs = pairs;
+        lut->allocated = len;
+    }
+    for (int64_t i = 0; i < len; i++)
+        lut->pairs[i] = hm_display_quantize(cfg->min, cfg->max, cfg->gray,
+                                            cfg->min + i);
+    lut->len = len;
+}
+
+static inline short
+hm_display_pair(struct hm_display *display, struct hm_cfg *cfg, int value)
+{
+    struct hm_display_lut *lut = &display->lut;
+    if (lut->len == 0)
+        return hm_display_quantize(cfg->min, cfg->max, cfg->gray, value);
+    if (value <= lut->min) return lut->pairs[0];
+    if ((int64_t)value - lut->min >= (int64_t)lut->len)
+        return lut->pairs[lut->len - 1];
+    return lut->pairs[value - lut->min];
+}
+
+/* Use the given part of the screen. A height of 0 means the whole
+ * screen. */
+void
+hm_display_area(struct hm_display *display, int y, int x, int height, int width)
+{
+    display->y = y;
+    display->x = x;
+    display->height = height;
+    display->width = width;
+    display->last.valid = false;
+}
+
+/* Forget about what is on screen, next frame is drawn entirely */
 void
-hm_display_data(struct hm_cfg *cfg, int *data, size_t len)
+hm_display_reset(struct hm_display *display)
 {
+    display->last.valid = false;
+}
+
+void
+hm_display_free(struct hm_display *display)
+{
+    free(display->lut.pairs);
+    free(display->last.pairs);
+    free(display->last.next);
+    free(display->last.values);
+    memset(display, 0, sizeof(*display));
+}
+
+/* Draw a frame in the area of the display. Only cells that changed since
+ * the last frame are drawn. Return true if something was drawn and the
+ * screen needs a refresh(). */
+bool
+hm_display_draw(struct hm_display *display, struct hm_cfg *cfg,
+                int *data, size_t len)
+{
+    struct hm_display_last *last = &display->last;
     size_t columns = cfg->width;   /* Number of columns */
     size_t lines = len / columns; /* Number of lines */
     int sheight, swidth;	      /* Screen height and width */
-    getmaxyx(stdscr, sheight, swidth);
+    if (display->height > 0) {
+        sheight = display->height;
+        swidth = display->width;
+    } else
+        getmaxyx(stdscr, sheight, swidth);
+    if (lines == 0) return false;
 
     /* Compute height and width of one cell */
     size_t cwidth = swidth / columns;
@@ -101,30 +203,128 @@ hm_display_data(struct hm_cfg *cfg, int *data, size_t len)
     if (cheight == 0) cheight = 1;
 
     /* Manage centering */
-    ssize_t offsetx = (swidth - cwidth * columns) / 2;
-    ssize_t offsety = (sheight - cheight * lines) / 2;
+    ssize_t offsetx = ((ssize_t)swidth - (ssize_t)(cwidth * columns)) / 2;
+    ssize_t offsety = ((ssize_t)sheight - (ssize_t)(cheight * lines)) / 2;
     if (offsetx < 0) offsetx = 0;
     if (offsety < 0) offsety = 0;
+    offsetx += display->x;
+    offsety += display->y;
+    display->cwidth = cwidth;
+    display->cheight = cheight;
+    display->offsetx = offsetx;
+    display->offsety = offsety;
 
+    /* Redraw everything if the geometry or the range changed */
+    bool full = (!last->valid || last->len != len || last->width != cfg->width ||
+                 last->min != cfg->min || last->max != cfg->max ||
+                 last->gray != cfg->gray);
+    bool track = true;
+    if (len > last->allocated) {
+        short *pairs = realloc(last->pairs, len * sizeof(short));
+        if (pairs) last->pairs = pairs;
+        short *next = realloc(last->next, len * sizeof(short));
+        if (next) last->next = next;
+        int *values = realloc(last->values, len * sizeof(int));
+        if (values) last->values = values;
+        if (pairs && next && values) last->allocated = len;
+        else track = false;
+    }
+    if (full) {
+        if (display->height > 0) {
+            attrset(A_NORMAL);
+            for (int y = 0; y < sheight; y++)
+                mvhline(display->y + y, display->x, ' ', swidth);
+        } else
+            erase();
+    }
+
+    /* Map the whole frame to colors first, then draw what changed */
+    uint64_t start = hm_latency_start();
+    hm_display_lut(display, cfg);
+    if (track)
+        for (size_t i = 0; i < len; i++)
+            last->next[i] = hm_display_pair(display, cfg, data[i]);
+    hm_latency_end(HM_STAGE_QUANTIZE, start);
+
+    start = hm_latency_start();
+    bool shown = cfg->values && cwidth > 3;
+    bool dirty = full;
     for (size_t i = 0; i < len; i++) {
-        short max;
-        if (cfg->gray)
-            max = MAXGRAY;
-        else
-            max = MAXCOLOR;
-        ssize_t gray = (data[i] - cfg->min) * max / (cfg->max - cfg->min);
-        if (gray >= max) gray = max - 1;
-        if (gray < 0) gray = 0;
+        short gray = track ? last->next[i] :
+            hm_display_pair(display, cfg, data[i]);
+        if (track) {
+            if (!full && last->pairs[i] == gray &&
+                (!shown || last->values[i] == data[i]))
+                continue;
+            last->pairs[i] = gray;
+            last->values[i] = data[i];
+        }
+        dirty = true;
         attrset(COLOR_PAIR(gray));
         for (size_t j = 0; j < cheight; j++) {
             move(offsety + (i / cfg->width) * cheight + j,
                  offsetx + (i % cfg->width) * cwidth);
-            if (cfg->values && j == cheight / 2 && cwidth > 3) {
-                printw("% *d", cwidth, data[i]);
+            if (shown && j == cheight / 2) {
+                printw("% *d", (int)cwidth, data[i]);
             } else {
-                printw("% *s", cwidth, " ");
+                printw("%*s", (int)cwidth, " ");
             }
         }
     }
-    refresh();
+    hm_latency_end(HM_STAGE_EMIT, start);
+
+    last->valid = track;
+    last->len = len;
+    last->width = cfg->width;
+    last->min = cfg->min;
+    last->max = cfg->max;
+    last->gray = cfg->gray;
+    return dirty;
+}
+
+/* Mark detected touches over the last frame drawn, in reverse video
+ * with the color of the cell below. Cells with a mark are drawn again
+ * with the next frame. */
+void
+hm_display_overlay(struct hm_display *display, const struct hm_frame *frame)
+{
+    struct hm_display_last *last = &display->last;
+    if (last->width == 0) return;
+    for (size_t i = 0; i < frame->nblobs; i++) {
+        const struct hm_blob *blob = &frame->blobs[i];
+        if (blob->x < -0.5 || blob->y < -0.5) continue;
+        size_t x = blob->x + 0.5, y = blob->y + 0.5;
+        size_t cell = y * last->width + x;
+        if (x >= last->width || cell >= last->len) continue;
+        short pair = 0;
+        if (last->valid) {
+            pair = last->pairs[cell];
+            last->pairs[cell] = -1;
+        }
+        attrset(COLOR_PAIR(pair) | A_REVERSE | A_BOLD);
+        mvaddch(display->offsety + (int)((blob->y + 0.5) * display->cheight),
+                display->offsetx + (int)((blob->x + 0.5) * display->cwidth),
+                '+');
+    }
+}
+
+/* The whole screen */
+static struct hm_display screen;
+
+void
+hm_display_invalidate(void)
+{
+    hm_display_reset(&screen);
+}
+
+void
+hm_display_data(struct hm_cfg *cfg, const struct hm_frame *frame)
+{
+    bool dirty = hm_display_draw(&screen, cfg, frame->data, frame->len);
+    hm_display_overlay(&screen, frame);
+    if (dirty || frame->nblobs > 0) {
+        uint64_t start = hm_latency_start();
+        refresh();
+        hm_latency_end(HM_STAGE_REFRESH, start);
+    }
 }
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+
+/*
+ * Export of frames as PPM stills or as a Y4M stream, without a
+ * terminal. Frames are copied into one of two buffers while the other
+ * one is scaled, colored and written by a dedicated thread. When the
+ * writer falls behind, acquisition waits for it instead of dropping
+ * frames. Colors are the ones of the display, with 256 levels.
+ */
+
+/* Number of levels of the colormap */
+#define HM_EXPORT_LEVELS 256
+
+/* Largest number of pixels per cell */
+#define HM_EXPORT_MAXZOOM 64
+
+static int
+hm_export_write(int fd, const unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1) return -1;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* A path for stills has exactly one %d, possibly with a width */
+bool
+hm_export_pattern(const char *path)
+{
+    int conversions = 0;
+    for (const char *p = path; *p; p++) {
+        if (*p != '%') continue;
+        if (*++p == '%') continue;
+        while (*p >= '0' && *p <= '9') p++;
+        if (*p != 'd') return false;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+/* Frames go to a Y4M stream rather than to stills */
+bool
+hm_export_stream(const char *path)
+{
+    size_t len = strlen(path);
+    return !strcmp(path, "-") ||
+        (len >= 4 && !strcasecmp(path + len - 4, ".y4m"));
+}
+
+/* Cells on each side of each pixel along an axis and the weight of the
+ * second one, out of 256. Pixels are centered on their cells. */
+static void
+hm_export_axis(unsigned int cells, unsigned int zoom, bool bilinear,
+               unsigned int *c0, unsigned int *c1, unsigned int *w)
+{
+    for (unsigned int o = 0; o < cells * zoom; o++) {
+        int pos = (int)((2 * o + 1) * 256 / (2 * zoom)) - 128;
+        if (!bilinear) pos = o / zoom * 256;
+        if (pos < 0) pos = 0;
+        c0[o] = pos >> 8;
+        w[o] = pos & 255;
+        if (c0[o] >= cells - 1) {
+            c0[o] = cells - 1;
+            w[o] = 0;
+        }
+        c1[o] = c0[o] + (w[o] ? 1 : 0);
+    }
+}
+
+/* Scale, color and write the frame in buffer i */
+static int
+hm_export_render(struct hm_export *export, unsigned int i)
+{
+    unsigned int width = export->width, height = export->height;
+    unsigned int pwidth = width * export->zoom;
+    size_t plane = (size_t)pwidth * height * export->zoom;
+    int low = export->low[i], high = export->high[i];
+    const int *cells = export->cells[i];
+
+    /* Levels with 8 bits of fraction, as hm_display_level() with 65536
+     * levels */
+    for (size_t c = 0; c < (size_t)width * height; c++) {
+        int64_t q = 0;
+        if (high > low)
+            q = ((int64_t)cells[c] - low) * 65536 / ((int64_t)high - low);
+        if (q > 65535) q = 65535;
+        if (q < 0) q = 0;
+        export->levels[c] = q;
+    }
+
+    unsigned char *p = export->image;
+    if (export->fd == -1)
+        p += sprintf((char *)p, "P6\n%u %u\n255\n", pwidth, height * export->zoom);
+    else {
+        memcpy(p, "FRAME\n", 6);
+        p += 6;
+    }
+    size_t header = p - export->image;
+
+    for (unsigned int y = 0; y < height * export->zoom; y++) {
+        const int *r0 = export->levels + (size_t)export->y0[y] * width;
+        const int *r1 = export->levels + (size_t)export->y1[y] * width;
+        uint32_t wy = export->wy[y];
+        for (unsigned int x = 0; x < pwidth; x++) {
+            uint32_t wx = export->wx[x];
+            uint32_t top = r0[export->x0[x]] * (256 - wx) + r0[export->x1[x]] * wx;
+            uint32_t bottom = r1[export->x0[x]] * (256 - wx) + r1[export->x1[x]] * wx;
+            export->row[x] = (top * (256 - wy) + bottom * wy) >> 24;
+        }
+        if (export->fd == -1) {
+            for (unsigned int x = 0; x < pwidth; x++, p += 3)
+                memcpy(p, export->colors[export->row[x]], 3);
+        } else {
+            unsigned char *py = p + (size_t)y * pwidth;
+            for (unsigned int x = 0; x < pwidth; x++) {
+                const unsigned char *color = export->colors[export->row[x]];
+                py[x] = color[0];
+                py[x + plane] = color[1];
+                py[x + 2 * plane] = color[2];
+            }
+        }
+    }
+    size_t len = header + 3 * plane;
+
+    if (export->fd != -1) {
+        if (export->written == 0) {
+            char stream[128];
+            int slen = snprintf(stream, sizeof(stream),
+                                "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n",
+                                pwidth, height * export->zoom, export->rate);
+            if (hm_export_write(export->fd, (unsigned char *)stream, slen) == -1)
+                return -1;
+        }
+        return hm_export_write(export->fd, export->image, len);
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), export->pattern, (int)export->written);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    if (hm_export_write(fd, export->image, len) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return close(fd);
+}
+
+static void *
+hm_export_run(void *arg)
+{
+    struct hm_export *export = arg;
+
+    pthread_mutex_lock(&export->lock);
+    while (1) {
+        while (export->pending == 0 && !export->stop)
+            pthread_cond_wait(&export->cond, &export->lock);
+        if (export->pending == 0) break;
+
+        unsigned int i = export->writing;
+        bool failed = export->error != 0;
+        pthread_mutex_unlock(&export->lock);
+
+        int error = 0;
+        if (!failed && hm_export_render(export, i) == -1) error = errno;
+        export->written++;
+
+        pthread_mutex_lock(&export->lock);
+        if (error && export->error == 0) export->error = error;
+        export->writing = (i + 1) % HM_EXPORT_BUFFERS;
+        export->pending--;
+        pthread_cond_signal(&export->cond);
+    }
+    pthread_mutex_unlock(&export->lock);
+    return NULL;
+}
+
+/* Export to path, a Y4M stream at rate frames per second if it ends
+ * with .y4m or is - for the standard output, PPM stills otherwise,
+ * numbered with a %d. Each cell is zoom pixels wide and high. */
+int
+hm_export_open(struct hm_export *export, const char *path, unsigned int zoom,
+               bool bilinear, bool gray, unsigned int rate)
+{
+    memset(export, 0, sizeof(*export));
+    export->fd = -1;
+    if (zoom == 0 || zoom > HM_EXPORT_MAXZOOM) {
+        errno = EINVAL;
+        return -1;
+    }
+    export->zoom = zoom;
+    export->bilinear = bilinear;
+    export->rate = rate;
+
+    /* A stream without a frame rate would claim one per second */
+    bool y4m = hm_export_stream(path);
+    if ((y4m && rate == 0) || (!y4m && !hm_export_pattern(path))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (y4m) {
+        export->fd = strcmp(path, "-") ?
+            open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) :
+            dup(STDOUT_FILENO);
+        if (export->fd == -1) return -1;
+    } else
+        export->pattern = path;
+
+    /* Colormap of the display, in BT.601 limited range for Y4M */
+    for (int i = 0; i < HM_EXPORT_LEVELS; i++) {
+        struct hm_color color;
+        hm_display_color(gray, i, HM_EXPORT_LEVELS, &color);
+        double r = color.red / 1000., g = color.green / 1000., b = color.blue / 1000.;
+        if (y4m) {
+            export->colors[i][0] = 16 + 65.481 * r + 128.553 * g + 24.966 * b + .5;
+            export->colors[i][1] = 128 - 37.797 * r - 74.203 * g + 112. * b + .5;
+            export->colors[i][2] = 128 + 112. * r - 93.786 * g - 18.214 * b + .5;
+        } else {
+            export->colors[i][0] = color.red * 255 / 1000;
+            export->colors[i][1] = color.green * 255 / 1000;
+            export->colors[i][2] = color.blue * 255 / 1000;
+        }
+    }
+
+    pthread_mutex_init(&export->lock, NULL);
+    pthread_cond_init(&export->cond, NULL);
+    if ((errno = pthread_create(&export->thread, NULL,
+                                hm_export_run, export)) != 0) {
+        pthread_mutex_destroy(&export->lock);
+        pthread_cond_destroy(&export->cond);
+        if (export->fd != -1) close(export->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Geometry is known with the first frame, setup the writer */
+static int
+hm_export_setup(struct hm_export *export, unsigned int width,
+                unsigned int height)
+{
+    unsigned int pwidth = width * export->zoom, pheight = height * export->zoom;
+    export->imagelen = 32 + 3 * (size_t)pwidth * pheight;
+    export->levels = malloc((size_t)width * height * sizeof(int));
+    export->row = malloc(pwidth);
+    export->x0 = malloc(3 * pwidth * sizeof(unsigned int));
+    export->y0 = malloc(3 * pheight * sizeof(unsigned int));
+    export->image = malloc(export->imagelen);
+    if (export->levels == NULL || export->row == NULL || export->x0 == NULL ||
+        export->y0 == NULL || export->image == NULL)
+        return -1;
+    export->x1 = export->x0 + pwidth;
+    export->wx = export->x1 + pwidth;
+    export->y1 = export->y0 + pheight;
+    export->wy = export->y1 + pheight;
+    hm_export_axis(width, export->zoom, export->bilinear,
+                   export->x0, export->x1, export->wx);
+    hm_export_axis(height, export->zoom, export->bilinear,
+                   export->y0, export->y1, export->wy);
+    export->width = width;
+    export->height = height;
+    return 0;
+}
+
+/* Hand a frame to the writer. Frames of another geometry than the first
+ * one are skipped. Fails once the writer failed. */
+int
+hm_export_frame(struct hm_export *export, struct hm_cfg *cfg,
+                const struct hm_frame *frame)
+{
+    if (export->width == 0) {
+        if (cfg->width == 0 || frame->len < cfg->width) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (hm_export_setup(export, cfg->width, frame->len / cfg->width) == -1)
+            return -1;
+    }
+    if (frame->len != (size_t)export->width * export->height ||
+        cfg->width != export->width) {
+        export->skipped++;
+        return 0;
+    }
+
+    unsigned int i = export->filling;
+    if (frame->len > export->allocated[i]) {
+        int *new = realloc(export->cells[i], frame->len * sizeof(int));
+        if (new == NULL) return -1;
+        export->cells[i] = new;
+        export->allocated[i] = frame->len;
+    }
+    memcpy(export->cells[i], frame->data, frame->len * sizeof(int));
+    export->low[i] = frame->low;
+    export->high[i] = frame->high;
+    export->frames++;
+
+    /* Queue it and wait for the other buffer to be free */
+    pthread_mutex_lock(&export->lock);
+    export->pending++;
+    pthread_cond_signal(&export->cond);
+    while (export->pending == HM_EXPORT_BUFFERS)
+        pthread_cond_wait(&export->cond, &export->lock);
+    export->filling = (i + 1) % HM_EXPORT_BUFFERS;
+    int error = export->error;
+    pthread_mutex_unlock(&export->lock);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Write pending frames and close the export */
+int
+hm_export_close(struct hm_export *export)
+{
+    pthread_mutex_lock(&export->lock);
+    export->stop = true;
+    pthread_cond_signal(&export->cond);
+    pthread_mutex_unlock(&export->lock);
+    pthread_join(export->thread, NULL);
+
+    int error = export->error;
+    if (export->fd != -1 && close(export->fd) == -1 && error == 0)
+        error = errno;
+    for (unsigned int i = 0; i < HM_EXPORT_BUFFERS; i++)
+        free(export->cells[i]);
+    free(export->levels);
+    free(export->row);
+    free(export->x0);
+    free(export->y0);
+    free(export->image);
+    pthread_mutex_destroy(&export->lock);
+    pthread_cond_destroy(&export->cond);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
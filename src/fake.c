@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Synthetic data source. Build a tree similar to the one exported to
+ * debugfs by the touchscreen driver and update the data files with
+ * moving touches over some noise:
+ *
+ *   ROOT/heatmap-fake/devN/{width,height,name,input_name,format,data}
+ *
+ * Point heatmap to it with --dbgfs-root ROOT. The tree is removed on
+ * exit.
+ */
+
+#include "heatmap.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+
+#define FAKE_DIR "heatmap-fake"
+
+/* Touches */
+#define FAKE_RADIUS 2.5
+#define FAKE_STRENGTH 800
+
+extern const char *__progname;
+
+struct hm_fake_touch {
+    double x, y;		/* Position, in cells */
+    double dx, dy;		/* Speed, in cells per frame */
+};
+
+struct hm_fake_device {
+    char dir[PATH_MAX];
+    int fd;			/* Data file */
+    struct hm_fake_touch *touches;
+};
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] ROOT\n",
+            __progname);
+    fprintf(stderr, "Version: %s\n", PACKAGE_STRING);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-d, --debug         Be more verbose.\n");
+    fprintf(stderr, "-c N, --count N     Number of devices (default: 1).\n");
+    fprintf(stderr, "-w W, --width W     Panel width (default: %s).\n", HM_DEFAULT_WIDTH);
+    fprintf(stderr, "-l H, --height H    Panel height (default: 11).\n");
+    fprintf(stderr, "-r R, --rate R      Frames per second, 0 for as fast as possible (default: 100).\n");
+    fprintf(stderr, "-t N, --touches N   Number of touches (default: 2).\n");
+    fprintf(stderr, "-n N, --noise N     Noise amplitude (default: 10).\n");
+    fprintf(stderr, "-f F, --format F    Data format (default: s16le).\n");
+    fprintf(stderr, "\n");
+}
+
+static bool stop = false;
+static void
+hm_fake_terminate()
+{
+    stop = true;
+}
+
+static unsigned int
+hm_fake_number(const char *name, const char *arg, unsigned long max)
+{
+    char *end;
+    errno = 0;
+    unsigned long val = strtoul(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || *arg == '\0' || val > max) {
+        fprintf(stderr, "%s should be an unsigned integer up to %lu, not `%s'\n",
+                name, max, arg);
+        usage();
+        exit(1);
+    }
+    return val;
+}
+
+/* Format a path, refusing to truncate it */
+static void
+hm_fake_path(char *path, size_t size, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+static void
+hm_fake_path(char *path, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(path, size, fmt, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= size) {
+        errno = ENAMETOOLONG;
+        fatal("fake", "unable to build path");
+    }
+}
+
+/* Write a small attribute file, like debugfs does */
+static void
+hm_fake_attribute(const char *dir, const char *name, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+static void
+hm_fake_attribute(const char *dir, const char *name, const char *fmt, ...)
+{
+    char path[PATH_MAX];
+    hm_fake_path(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) fatal("fake", "unable to create attribute file");
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(fp, fmt, ap);
+    va_end(ap);
+    fputc('\n', fp);
+    if (fclose(fp) != 0) fatal("fake", "unable to write attribute file");
+}
+
+static void
+hm_fake_remove(const char *dir)
+{
+    static const char *files[] = {
+        "width", "height", "name", "input_name", "format", "data"
+    };
+    char path[PATH_MAX];
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+/* Cheap noise */
+static inline uint32_t
+hm_fake_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Move touches, bouncing on the edges */
+static void
+hm_fake_move(struct hm_fake_touch *touches, unsigned int count,
+             unsigned int width, unsigned int height)
+{
+    for (unsigned int t = 0; t < count; t++) {
+        struct hm_fake_touch *touch = &touches[t];
+        touch->x += touch->dx;
+        touch->y += touch->dy;
+        if (touch->x < 0 || touch->x > width - 1) {
+            touch->dx = -touch->dx;
+            touch->x += 2 * touch->dx;
+        }
+        if (touch->y < 0 || touch->y > height - 1) {
+            touch->dy = -touch->dy;
+            touch->y += 2 * touch->dy;
+        }
+    }
+}
+
+static void
+hm_fake_frame(int *frame, unsigned int width, unsigned int height,
+              struct hm_fake_touch *touches, unsigned int count,
+              int strength, unsigned int noise, uint32_t *state)
+{
+    for (unsigned int y = 0; y < height; y++)
+        for (unsigned int x = 0; x < width; x++) {
+            int value = noise ?
+                (int)(hm_fake_random(state) % (2 * noise + 1)) - (int)noise : 0;
+            for (unsigned int t = 0; t < count; t++) {
+                double dx = x - touches[t].x, dy = y - touches[t].y;
+                double d2 = dx * dx + dy * dy;
+                if (d2 < FAKE_RADIUS * FAKE_RADIUS)
+                    value += strength * (1 - d2 / (FAKE_RADIUS * FAKE_RADIUS));
+            }
+            frame[y * width + x] = value;
+        }
+}
+
+/* Encoding of a format name: [su]bits then le, be or p for packed */
+struct hm_fake_encoding {
+    bool sign;
+    unsigned int bits;
+    bool big;
+    int64_t min, max;
+};
+
+static void
+hm_fake_encoding(const struct hm_decoder *decoder,
+                 struct hm_fake_encoding *encoding)
+{
+    encoding->sign = (decoder->name[0] == 's');
+    encoding->bits = atoi(decoder->name + 1);
+    encoding->big = (strstr(decoder->name, "be") != NULL);
+    if (encoding->sign) {
+        encoding->max = ((int64_t)1 << (encoding->bits - 1)) - 1;
+        encoding->min = -encoding->max - 1;
+    } else {
+        encoding->max = ((int64_t)1 << encoding->bits) - 1;
+        encoding->min = 0;
+    }
+    if (encoding->max > INT_MAX) encoding->max = INT_MAX;
+}
+
+/* Encode values, return the size of the raw data */
+static size_t
+hm_fake_encode(const struct hm_fake_encoding *encoding, const int *values,
+               size_t len, unsigned char *raw)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < len; i++) {
+        int64_t value = values[i];
+        if (value > encoding->max) value = encoding->max;
+        if (value < encoding->min) value = encoding->min;
+        uint32_t v = value;
+        if (encoding->bits == 12) {
+            v &= 0xfff;
+            if (i % 2 == 0) {
+                raw[size++] = v & 0xff;
+                raw[size++] = v >> 8;
+            } else {
+                raw[size - 1] |= (v & 0xf) << 4;
+                raw[size++] = v >> 4;
+            }
+            continue;
+        }
+        unsigned int bytes = encoding->bits / 8;
+        for (unsigned int b = 0; b < bytes; b++) {
+            unsigned int shift = encoding->big ? 8 * (bytes - 1 - b) : 8 * b;
+            raw[size++] = (v >> shift) & 0xff;
+        }
+    }
+    return size;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int debug = 1;
+    int ch;
+    unsigned int count = 1;
+    unsigned int width = atoi(HM_DEFAULT_WIDTH);
+    unsigned int height = 11;
+    unsigned int rate = 100;
+    unsigned int touches = 2;
+    unsigned int noise = 10;
+    const struct hm_decoder *decoder = hm_decoder_lookup(NULL);
+
+    static struct option long_options[] = {
+        { "debug", no_argument, 0, 'd' },
+        { "help",  no_argument, 0, 'h' },
+        { "count", required_argument, 0, 'c' },
+        { "width", required_argument, 0, 'w' },
+        { "height", required_argument, 0, 'l' },
+        { "rate", required_argument, 0, 'r' },
+        { "touches", required_argument, 0, 't' },
+        { "noise", required_argument, 0, 'n' },
+        { "format", required_argument, 0, 'f' },
+        { 0 }
+    };
+
+    int index_option;
+    while ((ch = getopt_long(argc, argv, "hdc:w:l:r:t:n:f:",
+                             long_options, &index_option)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage();
+            exit(0);
+            break;
+        case 'd':
+            debug++;
+            break;
+        case 'c':
+            count = hm_fake_number("count", optarg, MAX_DEBUGFS_CONFIGS);
+            break;
+        case 'w':
+            width = hm_fake_number("width", optarg, 4096);
+            break;
+        case 'l':
+            height = hm_fake_number("height", optarg, 4096);
+            break;
+        case 'r':
+            rate = hm_fake_number("rate", optarg, 1000000);
+            break;
+        case 't':
+            touches = hm_fake_number("touches", optarg, 100);
+            break;
+        case 'n':
+            noise = hm_fake_number("noise", optarg, 10000);
+            break;
+        case 'f':
+            decoder = hm_decoder_lookup(optarg);
+            if (decoder == NULL) {
+                fprintf(stderr, "unsupported format `%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 || count == 0 || width == 0 || height == 0) {
+        usage();
+        exit(1);
+    }
+    const char *root = argv[optind];
+
+    log_init(debug, __progname);
+
+    struct sigaction actterm;
+    sigemptyset(&actterm.sa_mask);
+    actterm.sa_flags = 0;
+    actterm.sa_handler = hm_fake_terminate;
+    if (sigaction(SIGTERM, &actterm, NULL) < 0 ||
+        sigaction(SIGINT, &actterm, NULL) < 0)
+        fatal("fake", "unable to register signals");
+
+    /* Build the tree */
+    char top[PATH_MAX];
+    hm_fake_path(top, sizeof(top), "%s/%s", root, FAKE_DIR);
+    if (mkdir(root, 0755) == -1 && errno != EEXIST)
+        fatal("fake", "unable to create root directory");
+    if (mkdir(top, 0755) == -1 && errno != EEXIST)
+        fatal("fake", "unable to create device directory");
+
+    /* Touches stay within the range of the format */
+    struct hm_fake_encoding encoding;
+    hm_fake_encoding(decoder, &encoding);
+    int strength = FAKE_STRENGTH;
+    if (encoding.max < FAKE_STRENGTH * 4 / 3)
+        strength = encoding.max * 3 / 4;
+
+    size_t len = (size_t)width * height;
+    int *frame = calloc(len, sizeof(int));
+    unsigned char *raw = calloc(len, sizeof(int32_t));
+    struct hm_fake_device *devices = calloc(count, sizeof(struct hm_fake_device));
+    if (frame == NULL || raw == NULL || devices == NULL) fatal("fake", NULL);
+    uint32_t state = 2463534242;
+    for (unsigned int i = 0; i < count; i++) {
+        struct hm_fake_device *device = &devices[i];
+        hm_fake_path(device->dir, sizeof(device->dir), "%s/dev%u", top, i);
+        if (mkdir(device->dir, 0755) == -1 && errno != EEXIST)
+            fatal("fake", "unable to create device directory");
+        hm_fake_attribute(device->dir, "width", "%u", width);
+        hm_fake_attribute(device->dir, "height", "%u", height);
+        hm_fake_attribute(device->dir, "name", "deltas");
+        hm_fake_attribute(device->dir, "input_name", "Fake touchscreen %u", i);
+        hm_fake_attribute(device->dir, "format", "%s", decoder->name);
+
+        char path[PATH_MAX];
+        hm_fake_path(path, sizeof(path), "%s/data", device->dir);
+        device->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (device->fd == -1) fatal("fake", "unable to create data file");
+
+        device->touches = calloc(touches ? touches : 1, sizeof(struct hm_fake_touch));
+        if (device->touches == NULL) fatal("fake", NULL);
+        for (unsigned int t = 0; t < touches; t++) {
+            struct hm_fake_touch *touch = &device->touches[t];
+            touch->x = hm_fake_random(&state) % width;
+            touch->y = hm_fake_random(&state) % height;
+            touch->dx = ((int)(hm_fake_random(&state) % 41) - 20) / 100.;
+            touch->dy = ((int)(hm_fake_random(&state) % 41) - 20) / 100.;
+        }
+    }
+    log_info("fake", "%u device(s) of %ux%u %s in %s at %u Hz",
+             count, width, height, decoder->name, top, rate);
+
+    /* Update data files. They are rewritten in place since readers keep
+     * them open. */
+    struct hm_schedule schedule;
+    hm_schedule_init(&schedule, rate, false);
+    unsigned long frames = 0;
+    uint64_t start = hm_schedule_now();
+    while (!stop) {
+        if (hm_schedule_wait(&schedule) == -1)
+            continue;
+        for (unsigned int i = 0; i < count; i++) {
+            struct hm_fake_device *device = &devices[i];
+            hm_fake_move(device->touches, touches, width, height);
+            hm_fake_frame(frame, width, height, device->touches, touches,
+                          strength, noise, &state);
+            size_t size = hm_fake_encode(&encoding, frame, len, raw);
+            if (pwrite(device->fd, raw, size, 0) != (ssize_t)size)
+                fatal("fake", "unable to write data file");
+        }
+        frames++;
+    }
+
+    uint64_t elapsed = hm_schedule_now() - start;
+    log_info("fake", "%lu frames in %.1f s, %lu overruns",
+             frames, elapsed / 1e9, schedule.overruns);
+    for (unsigned int i = 0; i < count; i++) {
+        close(devices[i].fd);
+        hm_fake_remove(devices[i].dir);
+        free(devices[i].touches);
+    }
+    rmdir(top);
+    free(devices);
+    free(frame);
+    free(raw);
+    return EXIT_SUCCESS;
+}
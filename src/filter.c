@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#  define HM_FILTER_X86
+#  include <immintrin.h>
+#endif
+
+/*
+ * Processing between decoding and display: subtraction of a captured
+ * baseline, median over the last frames and exponential moving
+ * average, in this order. All stages are done in a single pass over
+ * the decoded frame, in place, with integer arithmetic. The AVX2
+ * kernel must give the exact same results as the scalar one.
+ */
+
+/* Fractional bits of the moving average accumulator */
+#define HM_FILTER_FRACTION 8
+
+/* Inputs of the moving average are clamped to keep the accumulator in
+ * 32 bits */
+#define HM_FILTER_EMA_LIMIT ((1 << (31 - HM_FILTER_FRACTION - 1)) - 1)
+
+/* What to do with a frame */
+struct hm_filter_pass {
+    int *data;
+    int *base;			/* Baseline, NULL for none */
+    bool capture;		/* Store the frame as baseline first */
+    unsigned int median;	/* Frames in the median, 0 for none */
+    int *history[5];		/* Last frames */
+    unsigned int next;		/* Slot of this frame in history */
+    bool replicate;		/* Store this frame in every slot */
+    int32_t *acc;		/* Moving average, NULL for none */
+    unsigned int shift;		/* Weight of this frame is 2^-shift */
+    bool prime;			/* Start the moving average here */
+};
+
+/* Filter values from start to len, and return their extent */
+typedef void (*hm_filter_fn)(const struct hm_filter_pass *, size_t, size_t,
+                             int *, int *);
+
+static inline int
+hm_min(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static inline int
+hm_max(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+static inline int
+hm_median3(int a, int b, int c)
+{
+    return hm_max(hm_min(a, b), hm_min(hm_max(a, b), c));
+}
+
+/* Median of five: the median of the fifth value and of the middle two
+ * of the other four */
+static inline int
+hm_median5(int a, int b, int c, int d, int e)
+{
+    return hm_median3(e,
+                      hm_max(hm_min(a, b), hm_min(c, d)),
+                      hm_min(hm_max(a, b), hm_max(c, d)));
+}
+
+static void
+hm_filter_scalar(const struct hm_filter_pass *p, size_t start, size_t len,
+                 int *min, int *max)
+{
+    /* Stores through the buffers could alias the pass, copy it */
+    const struct hm_filter_pass q = *p;
+    int *const *h = q.history;
+    int lmin = INT_MAX, lmax = INT_MIN;
+    for (size_t i = start; i < len; i++) {
+        int x = q.data[i];
+        if (q.base) {
+            if (q.capture) q.base[i] = x;
+            /* Wraps like the vector version */
+            x = (int)((unsigned int)x - (unsigned int)q.base[i]);
+        }
+        if (q.median) {
+            if (q.replicate)
+                for (unsigned int k = 0; k < q.median; k++) h[k][i] = x;
+            else {
+                h[q.next][i] = x;
+                x = (q.median == 3) ?
+                    hm_median3(h[0][i], h[1][i], h[2][i]) :
+                    hm_median5(h[0][i], h[1][i], h[2][i], h[3][i], h[4][i]);
+            }
+        }
+        if (q.acc) {
+            x = hm_max(hm_min(x, HM_FILTER_EMA_LIMIT), -HM_FILTER_EMA_LIMIT);
+            if (q.prime)
+                q.acc[i] = x * (1 << HM_FILTER_FRACTION);
+            else {
+                int32_t a = q.acc[i];
+                a += (x * (1 << HM_FILTER_FRACTION) - a) >> q.shift;
+                q.acc[i] = a;
+                x = (a + (1 << (HM_FILTER_FRACTION - 1))) >> HM_FILTER_FRACTION;
+            }
+        }
+        q.data[i] = x;
+        lmin = hm_min(lmin, x);
+        lmax = hm_max(lmax, x);
+    }
+    *min = lmin;
+    *max = lmax;
+}
+
+#ifdef HM_FILTER_X86
+
+#define HM_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define HM_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+
+__attribute__((target("avx2")))
+static inline __m256i
+hm_median3_avx2(__m256i a, __m256i b, __m256i c)
+{
+    return _mm256_max_epi32(_mm256_min_epi32(a, b),
+                            _mm256_min_epi32(_mm256_max_epi32(a, b), c));
+}
+
+__attribute__((target("avx2")))
+static void
+hm_filter_avx2(const struct hm_filter_pass *p, size_t start, size_t len,
+               int *min, int *max)
+{
+    const struct hm_filter_pass q = *p;
+    int *const *h = q.history;
+    const __m256i limit = _mm256_set1_epi32(HM_FILTER_EMA_LIMIT);
+    const __m256i nlimit = _mm256_set1_epi32(-HM_FILTER_EMA_LIMIT);
+    const __m256i half = _mm256_set1_epi32(1 << (HM_FILTER_FRACTION - 1));
+    const __m128i count = _mm_cvtsi32_si128(q.shift);
+    __m256i vmin = _mm256_set1_epi32(INT_MAX);
+    __m256i vmax = _mm256_set1_epi32(INT_MIN);
+    size_t i = start;
+    for (; i + 8 <= len; i += 8) {
+        __m256i x = HM_LOAD(q.data + i);
+        if (q.base) {
+            if (q.capture) HM_STORE(q.base + i, x);
+            x = _mm256_sub_epi32(x, HM_LOAD(q.base + i));
+        }
+        if (q.median) {
+            if (q.replicate)
+                for (unsigned int k = 0; k < q.median; k++) HM_STORE(h[k] + i, x);
+            else {
+                HM_STORE(h[q.next] + i, x);
+                __m256i a = HM_LOAD(h[0] + i), b = HM_LOAD(h[1] + i);
+                __m256i c = HM_LOAD(h[2] + i);
+                if (q.median == 3)
+                    x = hm_median3_avx2(a, b, c);
+                else {
+                    __m256i d = HM_LOAD(h[3] + i);
+                    x = hm_median3_avx2(HM_LOAD(h[4] + i),
+                                        _mm256_max_epi32(_mm256_min_epi32(a, b),
+                                                         _mm256_min_epi32(c, d)),
+                                        _mm256_min_epi32(_mm256_max_epi32(a, b),
+                                                         _mm256_max_epi32(c, d)));
+                }
+            }
+        }
+        if (q.acc) {
+            x = _mm256_max_epi32(_mm256_min_epi32(x, limit), nlimit);
+            __m256i fx = _mm256_slli_epi32(x, HM_FILTER_FRACTION);
+            if (q.prime)
+                HM_STORE(q.acc + i, fx);
+            else {
+                __m256i a = HM_LOAD(q.acc + i);
+                a = _mm256_add_epi32(a, _mm256_sra_epi32(_mm256_sub_epi32(fx, a), count));
+                HM_STORE(q.acc + i, a);
+                x = _mm256_srai_epi32(_mm256_add_epi32(a, half), HM_FILTER_FRACTION);
+            }
+        }
+        HM_STORE(q.data + i, x);
+        vmin = _mm256_min_epi32(vmin, x);
+        vmax = _mm256_max_epi32(vmax, x);
+    }
+
+    /* Vectors are reduced first, so that the upper halves of registers
+     * are clean in the scalar code */
+    int vlmin = INT_MAX, vlmax = INT_MIN, lmin, lmax, t[8];
+    HM_STORE(t, vmin);
+    for (int k = 0; k < 8; k++) vlmin = hm_min(vlmin, t[k]);
+    HM_STORE(t, vmax);
+    for (int k = 0; k < 8; k++) vlmax = hm_max(vlmax, t[k]);
+    _mm256_zeroupper();
+    hm_filter_scalar(p, i, len, &lmin, &lmax);
+    *min = hm_min(lmin, vlmin);
+    *max = hm_max(lmax, vlmax);
+}
+
+#endif
+
+/* Best kernel for this CPU, picked on first use */
+static hm_filter_fn
+hm_filter_kernel(void)
+{
+    static hm_filter_fn kernel = NULL;
+    hm_filter_fn k = __atomic_load_n(&kernel, __ATOMIC_ACQUIRE);
+    if (k) return k;
+    k = hm_filter_scalar;
+#ifdef HM_FILTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) k = hm_filter_avx2;
+#endif
+    log_debug("filter", "using %s filter",
+              k == hm_filter_scalar ? "scalar" : "avx2");
+    __atomic_store_n(&kernel, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+/* Moving average with a weight of 2^-ema for new frames (0 to disable),
+ * median over the last median frames (0, 3 or 5) and subtraction of
+ * the first frame if baseline is set. */
+int
+hm_filter_init(struct hm_filter *filter, unsigned int ema,
+               unsigned int median, bool baseline)
+{
+    memset(filter, 0, sizeof(*filter));
+    if (ema > HM_FILTER_EMA_MAX || (median != 0 && median != 3 && median != 5)) {
+        errno = EINVAL;
+        return -1;
+    }
+    filter->ema = ema;
+    filter->median = median;
+    filter->baseline = baseline;
+    filter->capture = baseline;
+    return 0;
+}
+
+/* The same settings, with state of its own */
+void
+hm_filter_copy(struct hm_filter *filter, const struct hm_filter *from)
+{
+    hm_filter_init(filter, from->ema, from->median, from->baseline);
+}
+
+bool
+hm_filter_enabled(const struct hm_filter *filter)
+{
+    return filter->ema || filter->median || filter->baseline;
+}
+
+void
+hm_filter_free(struct hm_filter *filter)
+{
+    free(filter->base);
+    free(filter->history);
+    free(filter->acc);
+    filter->base = NULL;
+    filter->history = NULL;
+    filter->acc = NULL;
+    filter->len = 0;
+}
+
+/* Ask for the next frame to become the baseline. May be called from
+ * any thread. */
+void
+hm_filter_capture(struct hm_filter *filter)
+{
+    __atomic_store_n(&filter->capture, true, __ATOMIC_RELAXED);
+}
+
+/* Allocate state for frames of len values */
+static int
+hm_filter_setup(struct hm_filter *filter, size_t len)
+{
+    hm_filter_free(filter);
+    if (filter->baseline &&
+        (filter->base = calloc(len, sizeof(int))) == NULL) goto error;
+    if (filter->median &&
+        (filter->history = calloc(filter->median * len, sizeof(int))) == NULL)
+        goto error;
+    if (filter->ema &&
+        (filter->acc = calloc(len, sizeof(int32_t))) == NULL) goto error;
+    filter->len = len;
+    filter->filled = 0;
+    filter->next = 0;
+    filter->primed = false;
+    /* A new geometry needs a new baseline */
+    if (filter->baseline) hm_filter_capture(filter);
+    return 0;
+
+error:
+    hm_filter_free(filter);
+    return -1;
+}
+
+/* Filter a frame in place and update its minimum and maximum */
+int
+hm_filter_apply(struct hm_filter *filter, struct hm_frame *frame)
+{
+    if (!hm_filter_enabled(filter) || frame->len == 0) return 0;
+    hm_filter_fn kernel = hm_filter_kernel();
+    size_t len = frame->len;
+
+    /* State starts afresh with a new geometry or when going back in
+     * time, like when seeking in a capture */
+    if (len != filter->len && hm_filter_setup(filter, len) == -1) return -1;
+    if (frame->timestamp < filter->last) {
+        filter->filled = 0;
+        filter->primed = false;
+    }
+    filter->last = frame->timestamp;
+
+    struct hm_filter_pass pass = {
+        .data = frame->data,
+        .base = filter->base,
+        .capture = filter->baseline &&
+            __atomic_exchange_n(&filter->capture, false, __ATOMIC_RELAXED),
+        .median = filter->median,
+        .next = filter->next,
+        /* Until enough frames came in, the median is over copies of
+         * the first one */
+        .replicate = filter->filled == 0,
+        .acc = filter->acc,
+        .shift = filter->ema,
+        .prime = !filter->primed
+    };
+    for (unsigned int i = 0; i < filter->median; i++)
+        pass.history[i] = filter->history + i * len;
+    kernel(&pass, 0, len, &frame->min, &frame->max);
+
+    filter->primed = true;
+    if (filter->median) {
+        filter->next = (filter->next + 1) % filter->median;
+        if (filter->filled < filter->median) filter->filled++;
+    }
+    return 0;
+}
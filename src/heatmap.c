@@ -26,9 +26,25 @@
 #include <limits.h>
 #include <signal.h>
 #include <time.h>
+#include <poll.h>
 
 extern const char *__progname;
 
+/* Percentiles for automatic bounds and decay time constant */
+#define HM_AUTORANGE_DEFAULT "0.1,99.9,10"
+
+/* Largest number of polls per read while frames repeat */
+#define HM_BACKOFF_MAX 1000
+
+/* Histogram bins per cell when analyzing */
+#define HM_BINS_DEFAULT 16
+
+/* Pixels per cell when exporting */
+#define HM_ZOOM_DEFAULT "8"
+
+/* Full rate period after input events and idle rate */
+#define HM_IDLE_DEFAULT "1,1"
+
 static void
 usage(void)
 {
@@ -38,14 +54,50 @@ usage(void)
     fprintf(stderr, "\n");
     fprintf(stderr, "-d, --debug      Be more verbose.\n");
     fprintf(stderr, "-f n, --dbgfs n  debugfs device number to use.\n");
+    fprintf(stderr, "-F D, --dbgfs-root D  debugfs mount point (default: %s).\n", HM_DEFAULT_DEBUGFS);
     fprintf(stderr, "-p p, --path p   path to deltas file.\n");
+    fprintf(stderr, "-S P, --stream P Read back-to-back frames from P, - for stdin, a FIFO or a socket.\n");
+    fprintf(stderr, "-e F, --format F Data format, like s16le, u8 or s12p (default: s16le).\n");
     fprintf(stderr, "-r R, --rate R   Refresh rate (default: %s).\n", HM_DEFAULT_RATE);
     fprintf(stderr, "-w W, --width W  Touchscreen width (default: %s).\n", HM_DEFAULT_WIDTH);
+    fprintf(stderr, "-l H, --height H Touchscreen height, for frames of a fixed size.\n");
     fprintf(stderr, "-m M, --min M    Minimum heatmap value (default: %s).\n", HM_DEFAULT_MIN);
     fprintf(stderr, "-M M, --max M    Maximum heatmap value (default: %s).\n", HM_DEFAULT_MAX);
+    fprintf(stderr, "-a A, --autorange A  Percentiles and window for auto min/max (default: %s).\n",
+            HM_AUTORANGE_DEFAULT);
+    fprintf(stderr, "-E N, --ema N    Moving average giving a weight of 2^-N to new frames.\n");
+    fprintf(stderr, "-k K, --median K Median over the last K frames, 3 or 5.\n");
+    fprintf(stderr, "-b, --baseline   Subtract the first frame, or the next one after SIGUSR2.\n");
+    fprintf(stderr, "-B T, --blobs T  Detect and mark touches, cells of at least T.\n");
+    fprintf(stderr, "-O F, --blob-log F  Log detected touches to F or - for stderr.\n");
+    fprintf(stderr, "-A S, --stats S  Show a statistic of each cell over frames instead of values:\n"
+            "                 mean, stddev, variance, min, max or range.\n");
+    fprintf(stderr, "-W F, --stats-file F  Write statistics of each cell to F or - for stdout on exit.\n");
+    fprintf(stderr, "-i T, --idle T   Full rate until T s after a touch, then idle rate, as T[,R] (default: %s).\n",
+            HM_IDLE_DEFAULT);
+    fprintf(stderr, "-u D, --input D  Input device gating acquisition (default: from debugfs, implies -i).\n");
+    fprintf(stderr, "-n, --dedup      Skip frames identical to the previous one.\n");
+    fprintf(stderr, "-N M, --backoff M  Poll up to M times less often while frames repeat (implies -n).\n");
     fprintf(stderr, "-V, --values     Display heatmap values.\n");
     fprintf(stderr, "-s, --scan       Display scan results showing debugfs data sources.\n");
     fprintf(stderr, "-g, --gray       Use grayscale.\n");
+    fprintf(stderr, "-o P, --overrun P  Policy for late refreshes, skip or catchup (default: skip).\n");
+    fprintf(stderr, "-R F, --record F Record frames to a capture file.\n");
+    fprintf(stderr, "-T, --truecolor  Write 24-bit colors directly, without ncurses.\n");
+    fprintf(stderr, "-H, --halfblock  Use half blocks to show two rows per line (implies -T).\n");
+    fprintf(stderr, "-I F, --latency F  Measure latency of each stage, report to F or - for stderr.\n");
+    fprintf(stderr, "-X F, --export F Export frames as PPM stills numbered with a %%d, or a Y4M stream\n"
+            "                 for F ending with .y4m or - for stdout, without a terminal.\n");
+    fprintf(stderr, "-z Z, --zoom Z   Pixels per cell when exporting, as N[,bilinear] (default: %s).\n",
+            HM_ZOOM_DEFAULT);
+    fprintf(stderr, "-t, --tile       Display all debugfs devices side by side.\n");
+    fprintf(stderr, "-L F, --replay F Replay a capture file.\n");
+    fprintf(stderr, "-x S, --speed S  Replay speed, 0.1 to 100 or max (default: 1).\n");
+    fprintf(stderr, "-Y F, --analyze F  Analyze capture file F and write results to stdout.\n");
+    fprintf(stderr, "-j N, --threads N  Threads analyzing a capture (default: one per CPU).\n");
+    fprintf(stderr, "-G N, --bins N   Histogram bins per cell when analyzing (default: %d).\n",
+            HM_BINS_DEFAULT);
+    fprintf(stderr, "-P, --pipeline   Acquire data from a dedicated thread.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "see manual page " PACKAGE "(8) for more information\n");
 }
@@ -64,6 +116,69 @@ hm_resize()
     resize = true;
 }
 
+static bool dump = false;
+static void
+hm_dump()
+{
+    dump = true;
+}
+
+static bool rebase = false;
+static void
+hm_rebase()
+{
+    rebase = true;
+}
+
+/* Direct renderer in use instead of ncurses, if any */
+static struct hm_ansi *ansi = NULL;
+
+/* Where to write the latency report, "-" for stderr */
+static const char *latency = NULL;
+
+static void
+hm_latency_dump(void)
+{
+    if (!strcmp(latency, "-")) {
+        hm_latency_report(stderr);
+        return;
+    }
+    FILE *out = fopen(latency, "a");
+    if (out == NULL) {
+        log_warn("heatmap", "unable to open %s", latency);
+        return;
+    }
+    hm_latency_report(out);
+    fclose(out);
+}
+
+/* Write the latency report if requested with SIGUSR1. On stderr, the
+ * terminal is temporarily given back. */
+static void
+hm_latency_check(void)
+{
+    if (!dump) return;
+    dump = false;
+    if (latency == NULL) return;
+    if (strcmp(latency, "-")) {
+        hm_latency_dump();
+        return;
+    }
+    if (ansi) {
+        hm_ansi_suspend(ansi);
+        hm_latency_dump();
+        hm_ansi_resume(ansi);
+        return;
+    }
+    bool screen = !isendwin();
+    if (screen) {
+        def_prog_mode();
+        endwin();
+    }
+    hm_latency_dump();
+    if (screen) refresh();
+}
+
 static int
 hm_minmax_value(const char *value, int auto_value)
 {
@@ -96,21 +211,486 @@ hm_max_value(const char *value)
     return hm_minmax_value(value, INT_MIN);
 }
 
+static void
+hm_autorange_value(const char *value, struct hm_autorange *autorange)
+{
+    double low, high, window = 0;
+    char *end;
+    errno = 0;
+    low = strtod(value, &end);
+    if (errno == 0 && *end == ',') high = strtod(end + 1, &end);
+    else errno = EINVAL;
+    if (errno == 0 && *end == ',') window = strtod(end + 1, &end);
+    if (errno != 0 || *end != '\0' || low < 0 || high > 100 || low >= high ||
+        window < 0) {
+        fprintf(stderr, "auto range should be low,high[,seconds] with "
+                "0 <= low < high <= 100, not `%s'\n", value);
+        usage();
+        exit(1);
+    }
+    hm_autorange_init(autorange, low, high, window);
+}
+
+static void
+hm_zoom_value(const char *value, unsigned int *zoom, bool *bilinear)
+{
+    unsigned long uval;
+    char *end;
+    errno = 0;
+    uval = strtoul(value, &end, 10);
+    *bilinear = false;
+    if (errno == 0 && !strcmp(end, ",bilinear")) *bilinear = true;
+    else if (errno == 0 && !strcmp(end, ",nearest")) *bilinear = false;
+    else if (*end != '\0') errno = EINVAL;
+    if (errno != 0 || uval == 0 || uval > 64) {
+        fprintf(stderr, "zoom should be between 1 and 64, possibly followed "
+                "by ,nearest or ,bilinear, not `%s'\n", value);
+        usage();
+        exit(1);
+    }
+    *zoom = uval;
+}
+
+static void
+hm_idle_value(const char *value, struct hm_input *input)
+{
+    double tail, rate = 1;
+    char *end;
+    errno = 0;
+    tail = strtod(value, &end);
+    if (errno == 0 && *end == ',') rate = strtod(end + 1, &end);
+    if (errno != 0 || *end != '\0' || tail < 0 || rate <= 0 || rate > 1000) {
+        fprintf(stderr, "idle should be seconds[,rate] with a rate between "
+                "0 and 1000, not `%s'\n", value);
+        usage();
+        exit(1);
+    }
+    hm_input_init(input, tail, rate);
+}
+
+/* Write the statistics summary, - is for stdout */
+static void
+hm_stats_summary(const char *path, struct hm_cfg *cfg)
+{
+    FILE *out = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (out == NULL) {
+        log_warn("heatmap", "unable to open %s", path);
+        return;
+    }
+    if (hm_stats_write(cfg->stats, cfg->width, out) == -1 ||
+        (out != stdout && fclose(out) == EOF) || fflush(stdout) == EOF)
+        log_warn("heatmap", "unable to write statistics to %s", path);
+}
+
+/* Give the terminal back */
+static void
+hm_endwin(void)
+{
+    if (ansi) {
+        hm_ansi_free(ansi);
+        ansi = NULL;
+    } else
+        endwin();
+}
+
+/* Leaving through fatal() should not leave the alternate screen behind */
+static void
+hm_ansi_atexit(void)
+{
+    if (ansi) hm_endwin();
+}
+
+/* Seek step in replay mode, in ns */
+#define HM_REPLAY_SEEK (10 * 1000 * 1000 * 1000ULL)
+
+/* Decode a frame of a capture and process it like an acquired one */
+static void
+hm_replay_frame(struct hm_cfg *cfg, struct hm_replay *replay, size_t pos,
+                struct hm_frame *frame)
+{
+    if (hm_replay_decode(replay, pos, frame) <= 0) {
+        hm_endwin();
+        fatal("heatmap", "unable to decode capture frame");
+    }
+    if (rebase) {
+        rebase = false;
+        if (cfg->filter) hm_filter_capture(cfg->filter);
+        if (cfg->stats) hm_stats_reset(cfg->stats);
+    }
+    if (cfg->filter) {
+        uint64_t fstart = hm_latency_start();
+        if (hm_filter_apply(cfg->filter, frame) == -1) {
+            hm_endwin();
+            fatal("heatmap", "unable to filter capture frame");
+        }
+        hm_latency_end(HM_STAGE_FILTER, fstart);
+    }
+    if (cfg->blobs) {
+        uint64_t dstart = hm_latency_start();
+        if (hm_blobs_detect(cfg->blobs, cfg->width, frame) == -1) {
+            hm_endwin();
+            fatal("heatmap", "unable to detect touches");
+        }
+        hm_latency_end(HM_STAGE_DETECT, dstart);
+    }
+    if (cfg->stats) {
+        uint64_t sstart = hm_latency_start();
+        if (hm_stats_apply(cfg->stats, frame) == -1) {
+            hm_endwin();
+            fatal("heatmap", "unable to update statistics");
+        }
+        hm_latency_end(HM_STAGE_STATS, sstart);
+    }
+    frame->low = frame->min;
+    frame->high = frame->max;
+    if (cfg->autorange) hm_autorange_update(cfg->autorange, frame);
+    hm_autorange_apply(cfg, frame);
+}
+
+static void
+hm_replay_loop(struct hm_cfg *cfg, struct hm_replay *replay)
+{
+    struct hm_frame frame = { 0 };
+    size_t pos = 0;		/* Next frame to show */
+    size_t shown = 0;		/* Frame on screen */
+    bool paused = false;
+    bool redraw = true;
+    uint64_t start = hm_schedule_now();
+
+    keypad(stdscr, TRUE);
+    nodelay(stdscr, TRUE);
+    hm_replay_anchor(replay, pos);
+    while (!stop) {
+        hm_latency_check();
+        /* Wait for the next frame to be due or for a key */
+        uint64_t now = hm_schedule_now();
+        uint64_t deadline = hm_replay_deadline(replay, pos);
+        if (!redraw && (paused || deadline > now)) {
+            struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+            struct timespec ts = {
+                .tv_sec = (deadline - now) / (1000 * 1000 * 1000),
+                .tv_nsec = (deadline - now) % (1000 * 1000 * 1000)
+            };
+            ppoll(&pfd, 1, paused ? NULL : &ts, NULL);
+        }
+
+        int ch;
+        while ((ch = getch()) != ERR) {
+            switch (ch) {
+            case 'q':
+                stop = true;
+                break;
+            case ' ':
+                paused = !paused;
+                if (!paused && shown == replay->frames - 1) pos = 0;
+                break;
+            case KEY_RIGHT:
+                paused = true;
+                if (shown + 1 < replay->frames) pos = shown + 1;
+                break;
+            case KEY_LEFT:
+                paused = true;
+                if (shown > 0) pos = shown - 1;
+                break;
+            case KEY_NPAGE:
+                pos = hm_replay_seek(replay, hm_replay_timestamp(replay, shown) +
+                                     HM_REPLAY_SEEK);
+                break;
+            case KEY_PPAGE:
+                if (hm_replay_timestamp(replay, shown) < HM_REPLAY_SEEK)
+                    pos = 0;
+                else
+                    pos = hm_replay_seek(replay, hm_replay_timestamp(replay, shown) -
+                                         HM_REPLAY_SEEK);
+                break;
+            case KEY_HOME:
+                pos = 0;
+                break;
+            case KEY_END:
+                pos = replay->frames - 1;
+                break;
+            case '+':
+                if (replay->speed > 0 && replay->speed < 100) replay->speed *= 2;
+                if (replay->speed > 100) replay->speed = 100;
+                break;
+            case '-':
+                if (replay->speed > 0.1) replay->speed /= 2;
+                if (replay->speed > 0 && replay->speed < 0.1) replay->speed = 0.1;
+                break;
+            default:
+                continue;
+            }
+            hm_replay_anchor(replay, pos);
+            redraw = true;
+        }
+        if (resize) {
+            resize = false;
+            endwin();
+            refresh();
+            clear();
+            hm_display_invalidate();
+            redraw = true;
+        }
+        if (stop) break;
+        if (!redraw && (paused || hm_replay_deadline(replay, pos) > hm_schedule_now()))
+            continue;
+
+        hm_replay_frame(cfg, replay, pos, &frame);
+        hm_display_data(cfg, &frame);
+        shown = pos;
+        redraw = false;
+
+        if (!paused && ++pos == replay->frames) {
+            if (replay->speed == 0) break;
+            paused = true;
+            pos = replay->frames - 1;
+        }
+    }
+
+    uint64_t elapsed = hm_schedule_now() - start;
+    log_info("heatmap", "replayed %zu frames in %" PRIu64 " ms",
+             shown + 1, elapsed / (1000 * 1000));
+    hm_frame_free(&frame);
+}
+
+/* Export all frames of a capture, as fast as possible */
+static void
+hm_replay_export(struct hm_cfg *cfg, struct hm_replay *replay,
+                 struct hm_export *export)
+{
+    struct hm_frame frame = { 0 };
+    for (size_t pos = 0; pos < replay->frames && !stop; pos++) {
+        if (dump) {
+            dump = false;
+            if (latency) hm_latency_dump();
+        }
+        hm_replay_frame(cfg, replay, pos, &frame);
+        if (hm_export_frame(export, cfg, &frame) == -1)
+            fatal("heatmap", "unable to export frame");
+    }
+    hm_frame_free(&frame);
+}
+
+/* One device of the tiled view */
+struct hm_tile {
+    struct hm_cfg cfg;
+    struct hm_pipeline pipeline;
+    struct hm_display display;
+    unsigned long frames;	/* Frames displayed */
+    int error;			/* Acquisition error */
+    struct hm_autorange autorange;
+    struct hm_filter filter;
+    struct hm_blobs blobs;
+    struct hm_input input;
+    struct hm_dedup dedup;
+    struct hm_stats stats;
+};
+
+/* Draw the label above a tile */
+static void
+hm_tile_label(struct hm_tile *tile)
+{
+    const char *name = tile->cfg.name ? tile->cfg.name : tile->cfg.path;
+    int width = tile->display.width;
+    char label[256];
+
+    if (tile->error)
+        snprintf(label, sizeof(label), "%.*s: %s",
+                 (int)strcspn(name, "\n"), name, strerror(tile->error));
+    else
+        snprintf(label, sizeof(label), "%.*s: %lu frames [%d, %d]",
+                 (int)strcspn(name, "\n"), name, tile->frames,
+                 tile->cfg.min, tile->cfg.max);
+    attrset(A_NORMAL);
+    mvprintw(tile->display.y - 1, tile->display.x, "%-*.*s",
+             width, width, label);
+}
+
+/* Acquire all devices concurrently and display them side by side */
+static void
+hm_tile_loop(struct hm_cfg *cfg, struct hm_cfg cfgs[], int devs)
+{
+    struct hm_tile *tiles = calloc(devs, sizeof(struct hm_tile));
+    sem_t ready;
+
+    if (tiles == NULL || sem_init(&ready, 0, 0) == -1) {
+        hm_endwin();
+        fatal("heatmap", "unable to setup tiles");
+    }
+    for (int i = 0; i < devs; i++) {
+        struct hm_tile *tile = &tiles[i];
+        tile->cfg = *cfg;
+        tile->cfg.name = cfgs[i].name;
+        tile->cfg.input_name = cfgs[i].input_name;
+        tile->cfg.path = cfgs[i].path;
+        tile->cfg.format = cfgs[i].format;
+        tile->cfg.decoder = hm_decoder_lookup(tile->cfg.format);
+        if (tile->cfg.decoder == NULL) {
+            hm_endwin();
+            fatalx("heatmap", "unsupported data format");
+        }
+        tile->cfg.width = cfgs[i].width;
+        tile->cfg.height = cfgs[i].height;
+        tile->cfg.fd = -1;
+        if (cfg->autorange) {
+            tile->autorange = *cfg->autorange;
+            tile->cfg.autorange = &tile->autorange;
+        }
+        if (cfg->filter) {
+            hm_filter_copy(&tile->filter, cfg->filter);
+            tile->cfg.filter = &tile->filter;
+        }
+        if (cfg->blobs) {
+            hm_blobs_copy(&tile->blobs, cfg->blobs, tile->cfg.path);
+            tile->cfg.blobs = &tile->blobs;
+        }
+        if (cfg->stats) {
+            hm_stats_copy(&tile->stats, cfg->stats);
+            tile->cfg.stats = &tile->stats;
+        }
+        if (cfg->dedup) {
+            hm_dedup_init(&tile->dedup, cfg->dedup->backoff);
+            tile->cfg.dedup = &tile->dedup;
+        }
+        if (cfg->input) {
+            /* Devices without an input device are not gated */
+            char path[PATH_MAX];
+            tile->input = *cfg->input;
+            tile->cfg.input = NULL;
+            if (hm_input_find(cfgs[i].input_name, path, sizeof(path)) == -1 ||
+                hm_input_open(&tile->input, path) == -1)
+                log_warn("heatmap", "no input device for %s", tile->cfg.path);
+            else
+                tile->cfg.input = &tile->input;
+        }
+        if (hm_pipeline_start(&tile->pipeline, &tile->cfg, NULL, &ready) == -1) {
+            hm_endwin();
+            fatal("heatmap", "unable to start acquisition thread");
+        }
+    }
+
+    bool layout = true;
+    while (!stop) {
+        hm_latency_check();
+        if (rebase) {
+            rebase = false;
+            for (int i = 0; i < devs; i++) {
+                if (tiles[i].cfg.filter) hm_filter_capture(tiles[i].cfg.filter);
+                if (tiles[i].cfg.stats) hm_stats_reset(tiles[i].cfg.stats);
+            }
+        }
+        if (resize) {
+            resize = false;
+            endwin();
+            refresh();
+            layout = true;
+        }
+        if (layout) {
+            /* Grid as square as possible, a label line above each tile */
+            int sheight, swidth;
+            int columns = 1;
+            getmaxyx(stdscr, sheight, swidth);
+            while (columns * columns < devs) columns++;
+            int lines = (devs + columns - 1) / columns;
+            int theight = sheight / lines, twidth = swidth / columns;
+            erase();
+            for (int i = 0; i < devs; i++) {
+                hm_display_area(&tiles[i].display,
+                                (i / columns) * theight + 1,
+                                (i % columns) * twidth,
+                                theight > 1 ? theight - 1 : 1,
+                                twidth > 1 ? twidth - 1 : 1);
+                hm_tile_label(&tiles[i]);
+            }
+            layout = false;
+        }
+
+        bool dirty = false;
+        for (int i = 0; i < devs; i++) {
+            struct hm_tile *tile = &tiles[i];
+            struct hm_frame *frame = hm_pipeline_poll(&tile->pipeline);
+            if (frame == NULL) {
+                if (errno != 0 && tile->error == 0) {
+                    tile->error = errno;
+                    hm_tile_label(tile);
+                    dirty = true;
+                }
+                continue;
+            }
+            hm_autorange_apply(&tile->cfg, frame);
+            hm_display_draw(&tile->display, &tile->cfg, frame->data, frame->len);
+            hm_display_overlay(&tile->display, frame);
+            hm_pipeline_release(&tile->pipeline);
+            tile->frames++;
+            hm_tile_label(tile);
+            dirty = true;
+        }
+        if (dirty) refresh();
+
+        /* Wait for any device to publish a frame */
+        if (sem_wait(&ready) == 0)
+            while (sem_trywait(&ready) == 0);
+    }
+
+    for (int i = 0; i < devs; i++) {
+        hm_pipeline_stop(&tiles[i].pipeline);
+        hm_display_free(&tiles[i].display);
+        hm_filter_free(&tiles[i].filter);
+        hm_blobs_free(&tiles[i].blobs);
+        hm_stats_free(&tiles[i].stats);
+        if (tiles[i].cfg.input) hm_input_close(&tiles[i].input);
+    }
+    sem_destroy(&ready);
+    free(tiles);
+}
+
 int
 main(int argc, char *argv[])
 {
     int debug = 1;
     int dev = 0;
     int ch;
+    bool pipelined = false;
+    bool tiled = false;
+    bool direct = false;
+    const char *capture = NULL;
+    const char *replayed = NULL;
+    char *streamed = NULL;
+    double speed = 1;
+    double dval;
+    bool scan = false;
+    const char *root = HM_DEFAULT_DEBUGFS;
 
     struct hm_cfg cfgs[MAX_DEBUGFS_CONFIGS];
-
-    int devs = debugfs_get_config(cfgs);
+    static struct hm_autorange autorange;
+    hm_autorange_value(HM_AUTORANGE_DEFAULT, &autorange);
+    unsigned int ema = 0, median = 0;
+    bool baseline = false;
+    static struct hm_filter filter;
+    bool blobbed = false;
+    int threshold = 0;
+    const char *blogged = NULL;
+    static struct hm_blobs blobs;
+    bool gated = false;
+    const char *device = NULL;
+    static struct hm_input input;
+    hm_idle_value(HM_IDLE_DEFAULT, &input);
+    bool deduped = false;
+    unsigned int backoff = 1;
+    static struct hm_dedup dedup;
+    const char *exported = NULL;
+    static struct hm_stats stats;
+    const char *analyzed = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int bins = HM_BINS_DEFAULT;
+    const char *statted = NULL, *summary = NULL;
+    unsigned int zoom;
+    bool bilinear;
+    hm_zoom_value(HM_ZOOM_DEFAULT, &zoom, &bilinear);
 
     struct hm_cfg cfg = {
-        .path = cfgs[dev].path,
+        .fd = -1,
         .rate = atoi(HM_DEFAULT_RATE),
-        .width = cfgs[dev].width,
         .min = hm_min_value(HM_DEFAULT_MIN),
         .max = hm_max_value(HM_DEFAULT_MAX)
     };
@@ -120,21 +700,52 @@ main(int argc, char *argv[])
         { "help",  no_argument, 0, 'h' },
         { "version", no_argument, 0, 'v' },
         { "dbgfs", required_argument, 0, 'f' },
+        { "dbgfs-root", required_argument, 0, 'F' },
         { "path", required_argument, 0, 'p' },
+        { "format", required_argument, 0, 'e' },
+        { "stream", required_argument, 0, 'S' },
         { "rate", required_argument, 0, 'r' },
         { "width", required_argument, 0, 'w' },
+        { "height", required_argument, 0, 'l' },
         { "min", required_argument, 0, 'm' },
         { "max", required_argument, 0, 'M' },
+        { "autorange", required_argument, 0, 'a' },
+        { "ema", required_argument, 0, 'E' },
+        { "median", required_argument, 0, 'k' },
+        { "baseline", no_argument, 0, 'b' },
+        { "blobs", required_argument, 0, 'B' },
+        { "blob-log", required_argument, 0, 'O' },
+        { "stats", required_argument, 0, 'A' },
+        { "stats-file", required_argument, 0, 'W' },
+        { "idle", required_argument, 0, 'i' },
+        { "input", required_argument, 0, 'u' },
+        { "dedup", no_argument, 0, 'n' },
+        { "backoff", required_argument, 0, 'N' },
         { "values", no_argument, 0, 'V' },
         { "scan", no_argument, 0, 's' },
         { "gray", no_argument, 0, 'g' },
+        { "pipeline", no_argument, 0, 'P' },
+        { "overrun", required_argument, 0, 'o' },
+        { "record", required_argument, 0, 'R' },
+        { "replay", required_argument, 0, 'L' },
+        { "export", required_argument, 0, 'X' },
+        { "zoom", required_argument, 0, 'z' },
+        { "analyze", required_argument, 0, 'Y' },
+        { "threads", required_argument, 0, 'j' },
+        { "bins", required_argument, 0, 'G' },
+        { "tile", no_argument, 0, 't' },
+        { "latency", required_argument, 0, 'I' },
+        { "truecolor", no_argument, 0, 'T' },
+        { "halfblock", no_argument, 0, 'H' },
+        { "speed", required_argument, 0, 'x' },
         { 0 }
     };
 
     int index_option;
     unsigned long uval;
+    long lval;
     char *end;
-    while ((ch = getopt_long(argc, argv, "ghvdD:f:p:r:w:m:M:Vs",
+    while ((ch = getopt_long(argc, argv, "ghvdD:f:F:p:S:e:r:w:l:m:M:a:E:k:bB:O:A:W:i:u:nN:VsPo:R:L:x:X:z:Y:j:G:tTHI:",
                              long_options, &index_option)) != -1) {
         switch (ch) {
         case 'h':
@@ -153,15 +764,19 @@ main(int argc, char *argv[])
             break;
         case 'f':
             dev = atoi(optarg);
-            cfg.path = cfgs[dev].path;
-            cfg.width = cfgs[dev].width;
+            cfg.path = NULL;
+            break;
+        case 'F':
+            root = optarg;
             break;
         case 'p':
             cfg.path = optarg;
-            cfg.width = atoi(HM_DEFAULT_WIDTH);
-
-            if (devs == 0)
-                devs = 1;
+            break;
+        case 'e':
+            cfg.format = optarg;
+            break;
+        case 'S':
+            streamed = optarg;
             break;
         case 'r':
             errno = 0;
@@ -187,22 +802,192 @@ main(int argc, char *argv[])
             }
             cfg.width = uval;
             break;
+        case 'l':
+            errno = 0;
+            uval = strtoul(optarg, &end, 10);
+            if ((errno == ERANGE && (uval == ULONG_MAX || uval == 0)) ||
+                (errno != 0 && uval == 0) || *end != '\0') {
+                fprintf(stderr, "height should be an unsigned integer, not `%s'\n",
+                        optarg);
+                usage();
+                exit(1);
+            }
+            cfg.height = uval;
+            break;
         case 'm':
             cfg.min = hm_min_value(optarg);
             break;
         case 'M':
             cfg.max = hm_max_value(optarg);
             break;
+        case 'a':
+            hm_autorange_value(optarg, &autorange);
+            break;
+        case 'E':
+            errno = 0;
+            uval = strtoul(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || uval == 0 || uval > HM_FILTER_EMA_MAX) {
+                fprintf(stderr, "moving average should be between 1 and %d, not `%s'\n",
+                        HM_FILTER_EMA_MAX, optarg);
+                usage();
+                exit(1);
+            }
+            ema = uval;
+            break;
+        case 'k':
+            errno = 0;
+            uval = strtoul(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || (uval != 3 && uval != 5)) {
+                fprintf(stderr, "median should be over 3 or 5 frames, not `%s'\n",
+                        optarg);
+                usage();
+                exit(1);
+            }
+            median = uval;
+            break;
+        case 'b':
+            baseline = true;
+            break;
+        case 'B':
+            errno = 0;
+            lval = strtol(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || lval < INT_MIN || lval > INT_MAX) {
+                fprintf(stderr, "touch threshold should be an integer, not `%s'\n",
+                        optarg);
+                usage();
+                exit(1);
+            }
+            blobbed = true;
+            threshold = lval;
+            break;
+        case 'O':
+            blogged = optarg;
+            break;
+        case 'A':
+            if (hm_stats_init(&stats, optarg) == -1) {
+                fprintf(stderr, "statistic should be mean, stddev, variance, "
+                        "min, max or range, not `%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            statted = optarg;
+            break;
+        case 'W':
+            summary = optarg;
+            break;
+        case 'i':
+            hm_idle_value(optarg, &input);
+            gated = true;
+            break;
+        case 'u':
+            device = optarg;
+            gated = true;
+            break;
+        case 'n':
+            deduped = true;
+            break;
+        case 'N':
+            errno = 0;
+            uval = strtoul(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || uval == 0 || uval > HM_BACKOFF_MAX) {
+                fprintf(stderr, "backoff should be between 1 and %d, not `%s'\n",
+                        HM_BACKOFF_MAX, optarg);
+                usage();
+                exit(1);
+            }
+            deduped = true;
+            backoff = uval;
+            break;
         case 'V':
             cfg.values = true;
             break;
         case 's':
-            print_debugfs_devices(cfgs, devs);
-            exit(0);
+            scan = true;
             break;
         case 'g':
             cfg.gray = true;
             break;
+        case 'P':
+            pipelined = true;
+            break;
+        case 'R':
+            capture = optarg;
+            break;
+        case 'T':
+            direct = true;
+            break;
+        case 'H':
+            direct = true;
+            cfg.halfblock = true;
+            break;
+        case 'I':
+            latency = optarg;
+            hm_latency_enabled = true;
+            break;
+        case 't':
+            tiled = true;
+            break;
+        case 'L':
+            replayed = optarg;
+            break;
+        case 'X':
+            exported = optarg;
+            break;
+        case 'Y':
+            analyzed = optarg;
+            break;
+        case 'j':
+            errno = 0;
+            uval = strtoul(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || uval == 0 || uval > 1024) {
+                fprintf(stderr, "threads should be between 1 and 1024, not `%s'\n",
+                        optarg);
+                usage();
+                exit(1);
+            }
+            threads = uval;
+            break;
+        case 'G':
+            errno = 0;
+            uval = strtoul(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || uval == 0 || uval > HM_ANALYSIS_MAXBINS) {
+                fprintf(stderr, "bins should be between 1 and %d, not `%s'\n",
+                        HM_ANALYSIS_MAXBINS, optarg);
+                usage();
+                exit(1);
+            }
+            bins = uval;
+            break;
+        case 'z':
+            hm_zoom_value(optarg, &zoom, &bilinear);
+            break;
+        case 'x':
+            if (!strcmp(optarg, "max")) {
+                speed = 0;
+                break;
+            }
+            errno = 0;
+            dval = strtod(optarg, &end);
+            if (errno != 0 || *end != '\0' || dval < 0.1 || dval > 100) {
+                fprintf(stderr, "speed should be between 0.1 and 100 or max, not `%s'\n",
+                        optarg);
+                usage();
+                exit(1);
+            }
+            speed = dval;
+            break;
+        case 'o':
+            if (!strcmp(optarg, "skip"))
+                cfg.catchup = false;
+            else if (!strcmp(optarg, "catchup"))
+                cfg.catchup = true;
+            else {
+                fprintf(stderr, "overrun policy should be skip or catchup, not `%s'\n",
+                        optarg);
+                usage();
+                exit(1);
+            }
+            break;
         default:
             usage();
             exit(1);
@@ -211,11 +996,153 @@ main(int argc, char *argv[])
 
     cfg.auto_min = (cfg.min == INT_MAX);
     cfg.auto_max = (cfg.max == INT_MIN);
+    if (cfg.auto_min || cfg.auto_max)
+        cfg.autorange = &autorange;
+    hm_filter_init(&filter, ema, median, baseline);
+    if (hm_filter_enabled(&filter))
+        cfg.filter = &filter;
+    if (summary && statted == NULL)
+        hm_stats_init(&stats, "mean");
+    if (statted || summary)
+        cfg.stats = &stats;
+    if (deduped) {
+        hm_dedup_init(&dedup, backoff);
+        cfg.dedup = &dedup;
+    }
 
     log_init(debug, __progname);
 
-    if (devs == 0)
-        fatal("heatmap", "No data path");
+    if (blobbed) {
+        FILE *blog = NULL;
+        if (blogged && !strcmp(blogged, "-"))
+            blog = stderr;
+        else if (blogged && (blog = fopen(blogged, "a")) == NULL)
+            fatal("heatmap", "unable to open touch log");
+        hm_blobs_init(&blobs, threshold, blog);
+        cfg.blobs = &blobs;
+    } else if (blogged)
+        fatalx("heatmap", "logging touches needs a threshold, see -B");
+
+    if (analyzed) {
+        struct hm_replay capture;
+        struct hm_analysis analysis;
+        if (hm_replay_open(&capture, analyzed) == -1)
+            fatal("heatmap", "unable to open capture file");
+        uint64_t start = hm_schedule_now();
+        if (hm_analyze(&analysis, &capture, threads > 0 ? threads : 1, bins,
+                       blobbed, threshold) == -1)
+            fatal("heatmap", "unable to analyze capture file");
+        log_info("heatmap", "analyzed %lu frames in %" PRIu64 " ms with %u threads",
+                 analysis.frames, (hm_schedule_now() - start) / (1000 * 1000),
+                 analysis.workers);
+        if (hm_analysis_write(&analysis, &capture, stdout) == -1 ||
+            fflush(stdout) == EOF)
+            fatal("heatmap", "unable to write analysis");
+        if (latency) hm_latency_dump();
+        hm_analysis_free(&analysis);
+        hm_replay_close(&capture);
+        return EXIT_SUCCESS;
+    }
+
+    int found = debugfs_get_config(root, cfgs);
+    if (scan) {
+        print_debugfs_devices(cfgs, found);
+        exit(0);
+    }
+    if (streamed)
+        cfg.path = streamed;
+    if (cfg.path == NULL && !replayed) {
+        if (found == 0)
+            fatalx("heatmap", "No data path");
+        if (dev < 0 || dev >= found)
+            fatalx("heatmap", "No such debugfs device");
+        cfg.path = cfgs[dev].path;
+        if (cfg.width == 0)
+            cfg.width = cfgs[dev].width;
+        if (cfg.height == 0)
+            cfg.height = cfgs[dev].height;
+        if (cfg.format == NULL)
+            cfg.format = cfgs[dev].format;
+    }
+    cfg.decoder = hm_decoder_lookup(cfg.format);
+    if (cfg.decoder == NULL && !replayed && !tiled)
+        fatalx("heatmap", "unsupported data format");
+
+    struct hm_stream stream;
+    if (streamed) {
+        if (cfg.height == 0)
+            fatalx("heatmap", "the height of frames is needed to read a stream");
+        if (hm_stream_open(&stream, streamed,
+                           hm_decoder_size(cfg.decoder,
+                                           (size_t)cfg.width * cfg.height)) == -1)
+            fatal("heatmap", "unable to open stream");
+        cfg.stream = &stream;
+    }
+    if (cfg.width == 0)
+        cfg.width = atoi(HM_DEFAULT_WIDTH);
+    if (tiled && found == 0)
+        fatalx("heatmap", "No debugfs device to tile");
+    if (tiled && summary)
+        fatalx("heatmap", "statistics of tiles cannot be written");
+    if (tiled && capture)
+        fatalx("heatmap", "tiles cannot be recorded");
+    if (replayed && capture)
+        fatalx("heatmap", "a replay cannot be recorded");
+
+    struct hm_replay replay;
+    if (replayed) {
+        if (hm_replay_open(&replay, replayed) == -1)
+            fatal("heatmap", "unable to open capture file");
+        if (replay.frames == 0)
+            fatalx("heatmap", "empty capture file");
+        replay.speed = speed;
+        cfg.width = replay.width;
+    }
+
+    if (gated && tiled) {
+        /* Each tile opens its own device */
+        cfg.input = &input;
+    } else if (gated && !replayed) {
+        char path[PATH_MAX];
+        if (device == NULL) {
+            if (dev < 0 || dev >= found || cfg.path != cfgs[dev].path)
+                fatalx("heatmap", "no known input device, see -u");
+            if (hm_input_find(cfgs[dev].input_name, path, sizeof(path)) == -1)
+                fatal("heatmap", "unable to find input device");
+            device = path;
+        }
+        if (hm_input_open(&input, device) == -1)
+            fatal("heatmap", "unable to open input device");
+        cfg.input = &input;
+    }
+
+    struct hm_record record;
+    if (capture && hm_record_open(&record, capture) == -1)
+        fatal("heatmap", "unable to open capture file");
+
+    struct hm_export export;
+    if (exported) {
+        unsigned int rate = cfg.rate;
+        if (tiled)
+            fatalx("heatmap", "tiles cannot be exported");
+        if (replayed && replay.frames > 1) {
+            /* Average rate of the capture */
+            uint64_t span = hm_replay_timestamp(&replay, replay.frames - 1) -
+                hm_replay_timestamp(&replay, 0);
+            if (span > 0)
+                rate = (replay.frames - 1) * 1e9 / span + .5;
+        }
+        if (rate == 0 && hm_export_stream(exported))
+            fatalx("heatmap", "a Y4M stream needs a rate, see -r");
+        if (!hm_export_stream(exported) && !hm_export_pattern(exported))
+            fatalx("heatmap", "PPM stills need a %d in their name");
+        if (hm_export_open(&export, exported, zoom, bilinear, cfg.gray,
+                           rate) == -1)
+            fatal("heatmap", "unable to export frames");
+        /* The writer holds acquisition back when late, a ring between
+         * them would drop frames */
+        pipelined = false;
+    }
 
     /* Setup signals */
     struct sigaction actterm;
@@ -230,44 +1157,186 @@ main(int argc, char *argv[])
     actwinch.sa_handler = hm_resize;
     if (sigaction(SIGWINCH, &actwinch, NULL) < 0)
         fatal("heatmap", "unable to register SIGWINCH");
-    initscr();
-    cbreak();
-    noecho();
-    curs_set(0);
-    hm_display_init(&cfg);
+    struct sigaction actusr1;
+    sigemptyset(&actusr1.sa_mask);
+    actusr1.sa_flags = 0;
+    actusr1.sa_handler = hm_dump;
+    if (sigaction(SIGUSR1, &actusr1, NULL) < 0)
+        fatal("heatmap", "unable to register SIGUSR1");
+    struct sigaction actusr2;
+    sigemptyset(&actusr2.sa_mask);
+    actusr2.sa_flags = 0;
+    actusr2.sa_handler = hm_rebase;
+    if (sigaction(SIGUSR2, &actusr2, NULL) < 0)
+        fatal("heatmap", "unable to register SIGUSR2");
+    static struct hm_ansi truecolor;
+    bool curses = !exported && !(direct && !tiled && !replayed);
+    if (!curses) {
+        /* Without ncurses, interrupting is stopping */
+        if (sigaction(SIGINT, &actterm, NULL) < 0)
+            fatal("heatmap", "unable to register SIGINT");
+    }
+    if (!curses && !exported) {
+        if (hm_ansi_init(&truecolor, &cfg) == -1)
+            fatal("heatmap", "unable to setup terminal");
+        ansi = &truecolor;
+        atexit(hm_ansi_atexit);
+    } else if (curses) {
+        initscr();
+        /* Frames may come from stdin, don't look for keys there */
+        if (streamed) typeahead(-1);
+        cbreak();
+        noecho();
+        curs_set(0);
+        hm_display_init(&cfg);
+    }
+
+    if (tiled) {
+        hm_tile_loop(&cfg, cfgs, found);
+        hm_endwin();
+        if (latency) hm_latency_dump();
+        return EXIT_SUCCESS;
+    }
+
+    if (replayed && exported) {
+        hm_replay_export(&cfg, &replay, &export);
+        if (latency) hm_latency_dump();
+        log_info("heatmap", "%lu frames exported", export.frames);
+        if (hm_export_close(&export) == -1)
+            fatal("heatmap", "unable to write exported frames");
+        if (summary) hm_stats_summary(summary, &cfg);
+        hm_replay_close(&replay);
+        return EXIT_SUCCESS;
+    }
+
+    if (replayed) {
+        hm_replay_loop(&cfg, &replay);
+        hm_endwin();
+        if (latency) hm_latency_dump();
+        if (summary) hm_stats_summary(summary, &cfg);
+        hm_replay_close(&replay);
+        return EXIT_SUCCESS;
+    }
 
+    struct hm_pipeline pipeline;
+    if (pipelined &&
+        hm_pipeline_start(&pipeline, &cfg, capture ? &record : NULL,
+                          NULL) == -1) {
+        hm_endwin();
+        fatal("heatmap", "unable to start acquisition thread");
+    }
+
+    struct hm_schedule schedule;
+    hm_schedule_init(&schedule, cfg.rate, cfg.catchup);
+
+    struct hm_frame frame = { 0 };
     int err = 0;
     do {
-        if (cfg.rate > 0) {
-            const struct timespec ts = {
-                .tv_sec = 1 / cfg.rate,
-                .tv_nsec = ((cfg.rate > 1)?(1000 * 1000 * 1000 / cfg.rate):0)
-            };
-            nanosleep(&ts, NULL);
+        struct hm_frame *current;
+        hm_latency_check();
+        if (rebase) {
+            rebase = false;
+            if (cfg.filter) hm_filter_capture(cfg.filter);
+            if (cfg.stats) hm_stats_reset(cfg.stats);
         }
+        if (pipelined) {
+            current = hm_pipeline_next(&pipeline);
+            if (current == NULL) {
+                if (errno == EPIPE) {
+                    stop = true;
+                    continue;
+                }
+                if (errno != 0) {
+                    hm_endwin();
+                    fatal("heatmap", "unable to retrieve data");
+                }
+                continue;
+            }
+            hm_autorange_apply(&cfg, current);
+        } else {
+            if ((cfg.input ? hm_input_wait(cfg.input, &schedule) :
+                 hm_schedule_wait(&schedule)) == -1)
+                continue;
 
-        int *data;
-        size_t len;
-        len = hm_retrieve_data(&cfg, &data);
-        if (len == 0) {
-            if (err++ > 5) {
-                endwin();
-                fatalx("heatmap", "unable to retrieve data");
+            ssize_t len;
+            len = hm_retrieve_data(&cfg, &frame);
+            if (len == -1 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (len == -1 && errno == EPIPE) {
+                stop = true;
+                continue;
             }
-            continue;
+            if (len <= 0) {
+                if (len == 0) errno = 0;
+                log_debug("heatmap", "unable to retrieve data from %s",
+                          cfg.path);
+                if (err++ > 5) {
+                    hm_endwin();
+                    fatal("heatmap", "unable to retrieve data");
+                }
+                continue;
+            }
+            err = 0;
+            current = &frame;
+            if (capture) hm_record_frame(&record, &cfg, current);
         }
-        err = 0;
         if (resize) {
             resize = false;
-            endwin();
-            refresh();
-            clear();
+            if (ansi)
+                hm_ansi_invalidate(ansi);
+            else {
+                endwin();
+                refresh();
+                clear();
+                hm_display_invalidate();
+            }
         }
-        hm_display_data(&cfg, data, len);
-        free(data);
+        if (exported) {
+            if (hm_export_frame(&export, &cfg, current) == -1)
+                fatal("heatmap", "unable to export frame");
+        } else if (ansi)
+            hm_ansi_data(ansi, &cfg, current);
+        else
+            hm_display_data(&cfg, current);
+        if (pipelined) hm_pipeline_release(&pipeline);
     } while (!stop);
 
-    endwin();
+    hm_endwin();
+    if (latency) hm_latency_dump();
+    if (pipelined) {
+        hm_pipeline_stop(&pipeline);
+        log_info("heatmap", "%lu frames dropped",
+                 hm_ring_dropped(&pipeline.ring));
+        schedule = pipeline.schedule;
+    }
+    log_info("heatmap", "%lu overruns, %lu refreshes skipped",
+             schedule.overruns, schedule.skipped);
+    if (cfg.input) {
+        log_info("heatmap", "%lu input events, %lu wakeups, %lu frames while idle",
+                 input.events, input.wakeups, input.idles);
+        hm_input_close(&input);
+    }
+    if (cfg.dedup)
+        log_info("heatmap", "%lu frames read, %lu unique, %.1f unique frames "
+                 "per second, %lu polls skipped", dedup.frames, dedup.unique,
+                 hm_dedup_rate(&dedup), dedup.skipped);
+    if (streamed) {
+        log_info("heatmap", "%lu frames read from stream, %lu dropped%s",
+                 stream.frames, stream.dropped,
+                 stream.eof ? ", end of stream" : "");
+        hm_stream_close(&stream);
+    }
+    if (capture && hm_record_close(&record) == -1)
+        log_warn("heatmap", "unable to write capture file %s", capture);
+    if (summary) hm_stats_summary(summary, &cfg);
+    if (exported) {
+        log_info("heatmap", "%lu frames exported, %lu of another size skipped",
+                 export.frames, export.skipped);
+        if (hm_export_close(&export) == -1)
+            fatal("heatmap", "unable to write exported frames");
+    }
+    hm_retrieve_close(&cfg);
+    hm_frame_free(&frame);
 
     return EXIT_SUCCESS;
 }
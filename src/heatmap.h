@@ -27,6 +27,11 @@
 #include "debugfs.h"
 
 #include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <inttypes.h>
+#include <time.h>
+#include <stdio.h>
 
 #if defined HAVE_NCURSESW_CURSES_H
 #  include <ncursesw/curses.h>
@@ -42,8 +47,554 @@
 #  error "SysV or X/Open-compatible Curses header file required"
 #endif
 
-size_t hm_retrieve_data(struct hm_cfg *, int **);
+/* Most blobs kept per frame */
+#define HM_BLOB_MAX 16
+
+/* A touch, from hm_blobs_detect(). Positions are in cells, with cell
+ * centers on integers. */
+struct hm_blob {
+    double x;			/* Weighted centroid */
+    double y;
+    int area;			/* Number of cells */
+    int peak;			/* Largest value */
+    int64_t weight;		/* Sum of values above threshold */
+};
+
+/* A frame, as read from the data file. Buffers are owned by the caller
+ * and reused from one frame to the next. */
+struct hm_frame {
+    int *data;			/* Decoded values */
+    size_t len;			/* Number of decoded values */
+    size_t allocated;		/* Number of values data can hold */
+    int min;			/* Smallest value of the frame */
+    int max;			/* Largest value of the frame */
+    int low;			/* Range to display, from auto-ranging */
+    int high;
+    uint64_t timestamp;		/* Acquisition time, ns of CLOCK_MONOTONIC */
+    char *raw;			/* Raw content of the data file */
+    size_t rawlen;		/* Size of raw content */
+    size_t rawallocated;	/* Size of raw buffer */
+    struct hm_blob blobs[HM_BLOB_MAX]; /* Detected touches */
+    size_t nblobs;
+};
+
+ssize_t hm_retrieve_data(struct hm_cfg *, struct hm_frame *);
+void hm_retrieve_close(struct hm_cfg *);
+int hm_frame_reserve(struct hm_frame *, size_t);
+void hm_frame_free(struct hm_frame *);
+/* Absolute deadline frame scheduler */
+struct hm_schedule {
+    uint64_t next;		/* Next deadline, in ns of CLOCK_MONOTONIC */
+    uint64_t period;		/* Period in ns, 0 for no wait */
+    bool catchup;		/* Keep missed deadlines instead of skipping */
+    unsigned long overruns;	/* Deadlines already passed when waiting */
+    unsigned long skipped;	/* Deadlines skipped */
+};
+
+void hm_schedule_init(struct hm_schedule *, unsigned int, bool);
+int hm_schedule_wait(struct hm_schedule *);
+uint64_t hm_schedule_now(void);
+
+/* Latency instrumentation */
+enum hm_stage {
+    HM_STAGE_WAIT,		/* Waiting for the next refresh */
+    HM_STAGE_READ,		/* Opening and reading the data file */
+    HM_STAGE_DECODE,		/* Decoding raw data */
+    HM_STAGE_FILTER,		/* Filtering decoded values */
+    HM_STAGE_DETECT,		/* Detecting touches */
+    HM_STAGE_STATS,		/* Updating statistics of cells */
+    HM_STAGE_QUANTIZE,		/* Mapping values to colors */
+    HM_STAGE_EMIT,		/* Drawing changed cells */
+    HM_STAGE_REFRESH,		/* Sending the frame to the terminal */
+    HM_STAGES
+};
+
+/* Log-linear buckets, like HDR histograms: values below 2^HM_LOGLIN_SUB
+ * are exact, above, each power of two is split in 2^HM_LOGLIN_SUB
+ * buckets, which keeps the relative error under 3%. */
+#define HM_LOGLIN_SUB 5
+
+/* Number of buckets for values below 2^bits */
+#define HM_LOGLIN_BUCKETS(bits) (((bits) - HM_LOGLIN_SUB + 1) << HM_LOGLIN_SUB)
+
+static inline size_t
+hm_loglin_bucket(uint64_t v)
+{
+    if (v < (1 << HM_LOGLIN_SUB)) return v;
+    int shift = 63 - __builtin_clzll(v) - HM_LOGLIN_SUB;
+    return ((size_t)(shift + 1) << HM_LOGLIN_SUB) +
+        (v >> shift) - (1 << HM_LOGLIN_SUB);
+}
+
+/* Lowest and highest values falling in a bucket */
+static inline uint64_t
+hm_loglin_low(size_t index)
+{
+    if (index < (1 << HM_LOGLIN_SUB)) return index;
+    int shift = (index >> HM_LOGLIN_SUB) - 1;
+    uint64_t base = (index & ((1 << HM_LOGLIN_SUB) - 1)) + (1 << HM_LOGLIN_SUB);
+    return base << shift;
+}
+
+static inline uint64_t
+hm_loglin_high(size_t index)
+{
+    if (index < (1 << HM_LOGLIN_SUB)) return index;
+    int shift = (index >> HM_LOGLIN_SUB) - 1;
+    uint64_t base = (index & ((1 << HM_LOGLIN_SUB) - 1)) + (1 << HM_LOGLIN_SUB);
+    return ((base + 1) << shift) - 1;
+}
+
+extern bool hm_latency_enabled;
+void hm_latency_record(enum hm_stage, uint64_t);
+void hm_latency_report(FILE *);
+
+/* Start timing a stage, return 0 when instrumentation is disabled */
+static inline uint64_t
+hm_latency_start(void)
+{
+    return hm_latency_enabled ? hm_schedule_now() : 0;
+}
+
+static inline void
+hm_latency_end(enum hm_stage stage, uint64_t start)
+{
+    if (start) hm_latency_record(stage, hm_schedule_now() - start);
+}
+
+/* Capture files */
+#define HM_CAPTURE_MAGIC { 'H', 'M', 'C', 'A', 'P', '0', '0', '1' }
+
+struct hm_capture_header {
+    char magic[8];
+    uint32_t width;		/* Number of columns */
+    uint32_t height;		/* Number of lines of the first frame */
+    char format[16];		/* Data format, as given by debugfs */
+};
+
+struct hm_capture_frame {
+    uint64_t timestamp;		/* Acquisition time, in ns */
+    uint32_t size;		/* Size of the raw frame following */
+    uint32_t reserved;
+};
+
+struct hm_capture_index {
+    uint64_t offset;		/* Offset of struct hm_capture_frame */
+    uint64_t timestamp;
+};
+
+struct hm_capture_footer {
+    uint64_t index;		/* Offset of the first struct hm_capture_index */
+    uint64_t frames;		/* Number of frames */
+    char magic[8];
+};
+
+#define HM_RECORD_BUFFERS 4
+
+/* Capture file being written */
+struct hm_record {
+    int fd;
+    uint64_t offset;		/* Offset of the next byte to append */
+    struct hm_capture_index *index;
+    size_t frames;		/* Number of frames recorded */
+    size_t indexed;		/* Number of frames index can hold */
+    char *buffers[HM_RECORD_BUFFERS];
+    size_t allocated[HM_RECORD_BUFFERS];
+    size_t used[HM_RECORD_BUFFERS];
+    unsigned int filling;	/* Buffer being filled */
+    unsigned int writing;	/* Next buffer to write */
+    unsigned int pending;	/* Buffers waiting to be written */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool stop;
+    int error;			/* First write error */
+};
+
+int hm_record_open(struct hm_record *, const char *);
+int hm_record_frame(struct hm_record *, struct hm_cfg *, struct hm_frame *);
+int hm_record_close(struct hm_record *);
+
+/* Capture file being replayed */
+struct hm_replay {
+    const char *map;		/* Whole capture file */
+    size_t size;
+    const struct hm_capture_index *index;
+    size_t frames;		/* Number of frames */
+    unsigned int width;
+    unsigned int height;
+    char format[16];
+    const struct hm_decoder *decoder;
+    double speed;		/* Playback speed, 0 for as fast as possible */
+    uint64_t origin;		/* Time at which base was played */
+    uint64_t base;		/* Timestamp of the frame played at origin */
+};
+
+int hm_replay_open(struct hm_replay *, const char *);
+void hm_replay_close(struct hm_replay *);
+uint64_t hm_replay_timestamp(struct hm_replay *, size_t);
+ssize_t hm_replay_decode(struct hm_replay *, size_t, struct hm_frame *);
+size_t hm_replay_seek(struct hm_replay *, uint64_t);
+
+/* Results of the analysis of a capture */
+struct hm_analysis {
+    size_t len;			/* Cells per frame */
+    unsigned long frames;	/* Frames analyzed */
+    unsigned long skipped;	/* Frames of another size */
+    unsigned int workers;	/* Threads used */
+    bool thresholded;		/* Count crossings and peaks */
+    int threshold;
+    int *ref;			/* First frame, sums are relative to it */
+    int64_t *sum;
+    uint64_t *sqlo;		/* Sum of squares, 128 bits */
+    uint64_t *sqhi;
+    int *min;
+    int *max;
+    unsigned long *crossings;	/* Frames going from below to threshold */
+    unsigned long *peaks;	/* Frames peaking at a cell, over threshold */
+    int peak;			/* Largest value, first seen at */
+    size_t peakcell;
+    size_t peakframe;
+    unsigned int bins;		/* Histogram of each cell */
+    int low;			/* Range of histograms, all values */
+    int high;
+    uint64_t scale;		/* Bins per value, 32 bits of fraction */
+    unsigned long *hist;
+};
+
+#define HM_ANALYSIS_MAXBINS 256
+
+int hm_analyze(struct hm_analysis *, struct hm_replay *, unsigned int,
+               unsigned int, bool, int);
+int hm_analysis_write(const struct hm_analysis *, struct hm_replay *, FILE *);
+void hm_analysis_free(struct hm_analysis *);
+
+#define HM_EXPORT_BUFFERS 2
+
+/* Export of frames as images */
+struct hm_export {
+    int fd;			/* Y4M stream, -1 for PPM stills */
+    const char *pattern;	/* Path of PPM stills, with a %d */
+    unsigned int zoom;		/* Pixels per cell, in each direction */
+    bool bilinear;		/* Interpolate between cells */
+    unsigned int rate;		/* Frames per second of the stream */
+    unsigned int width;		/* Geometry of frames, from the first one */
+    unsigned int height;
+    unsigned char colors[256][3]; /* RGB, or YCbCr for Y4M */
+    int *cells[HM_EXPORT_BUFFERS];
+    size_t allocated[HM_EXPORT_BUFFERS];
+    int low[HM_EXPORT_BUFFERS];	/* Range of each frame */
+    int high[HM_EXPORT_BUFFERS];
+    unsigned int filling;	/* Buffer being filled */
+    unsigned int writing;	/* Next buffer to write */
+    unsigned int pending;	/* Buffers waiting to be written */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool stop;
+    int error;			/* First write error */
+    unsigned long frames;	/* Frames handed to the writer */
+    unsigned long skipped;	/* Frames of another geometry */
+    unsigned long written;	/* Frames written, writer side */
+    int *levels;		/* Levels of cells, 8 bits of fraction */
+    unsigned char *row;		/* Levels of a row of pixels */
+    unsigned int *x0, *x1, *wx;	/* Interpolation between cells, */
+    unsigned int *y0, *y1, *wy;	/* for each column and row of pixels */
+    unsigned char *image;	/* Frame being written */
+    size_t imagelen;
+};
+
+bool hm_export_stream(const char *);
+bool hm_export_pattern(const char *);
+int hm_export_open(struct hm_export *, const char *, unsigned int, bool,
+                   bool, unsigned int);
+int hm_export_frame(struct hm_export *, struct hm_cfg *, const struct hm_frame *);
+int hm_export_close(struct hm_export *);
+void hm_replay_anchor(struct hm_replay *, size_t);
+uint64_t hm_replay_deadline(struct hm_replay *, size_t);
+
+/* Frame ring between an acquisition thread and the renderer */
+struct hm_ring {
+    struct hm_frame *slots;
+    size_t size;
+    size_t head __attribute__((aligned(64)));	/* Staging slot, producer */
+    size_t tail __attribute__((aligned(64)));	/* Oldest slot in use, consumer */
+    unsigned long overwritten;	/* Staging frames overwritten, producer */
+    unsigned long skipped;	/* Published frames skipped, consumer */
+};
+
+int hm_ring_init(struct hm_ring *, size_t);
+void hm_ring_free(struct hm_ring *);
+struct hm_frame *hm_ring_staging(struct hm_ring *);
+bool hm_ring_publish(struct hm_ring *);
+struct hm_frame *hm_ring_newest(struct hm_ring *);
+void hm_ring_release(struct hm_ring *);
+unsigned long hm_ring_dropped(struct hm_ring *);
+
+/* Acquisition thread */
+struct hm_pipeline {
+    struct hm_cfg cfg;		/* Configuration used by the thread */
+    struct hm_ring ring;
+    struct hm_schedule schedule;
+    struct hm_record *record;	/* Capture file or NULL */
+    pthread_t thread;
+    sem_t *ready;		/* Posted when a frame is published */
+    sem_t own;
+    bool stop;
+    int error;			/* Reason acquisition stopped */
+};
+
+int hm_pipeline_start(struct hm_pipeline *, struct hm_cfg *,
+                      struct hm_record *, sem_t *);
+void hm_pipeline_stop(struct hm_pipeline *);
+struct hm_frame *hm_pipeline_next(struct hm_pipeline *);
+struct hm_frame *hm_pipeline_poll(struct hm_pipeline *);
+void hm_pipeline_release(struct hm_pipeline *);
+
+/* Stream of back-to-back frames */
+struct hm_stream {
+    int fd;
+    char *buf;			/* Read buffer */
+    size_t allocated;
+    size_t len;			/* Bytes in the read buffer */
+    size_t size;		/* Size of a frame, in bytes */
+    bool eof;
+    bool pending;		/* FIFO with no data from a writer yet */
+    unsigned long frames;	/* Frames read */
+    unsigned long dropped;	/* Frames replaced by a newer one */
+};
+
+int hm_stream_open(struct hm_stream *, const char *, size_t);
+void hm_stream_close(struct hm_stream *);
+ssize_t hm_stream_read(struct hm_stream *, struct hm_frame *);
+
+/* Automatic range from percentiles of recent values */
+#define HM_AUTORANGE_HALF HM_LOGLIN_BUCKETS(31)
+#define HM_AUTORANGE_BUCKETS (2 * HM_AUTORANGE_HALF)
+
+struct hm_autorange {
+    uint64_t counts[HM_AUTORANGE_BUCKETS];
+    uint64_t total;
+    uint64_t last;		/* Timestamp of the last frame */
+    double low;			/* Percentile used as minimum */
+    double high;		/* Percentile used as maximum */
+    double window;		/* Decay time constant, in s, 0 for none */
+};
+
+void hm_autorange_init(struct hm_autorange *, double, double, double);
+void hm_autorange_reset(struct hm_autorange *);
+void hm_autorange_update(struct hm_autorange *, struct hm_frame *);
+void hm_autorange_apply(struct hm_cfg *, const struct hm_frame *);
+
+/* Processing of decoded frames */
+#define HM_FILTER_EMA_MAX 8
+
+struct hm_filter {
+    unsigned int ema;		/* Weight of new frames is 2^-ema, 0 for none */
+    unsigned int median;	/* Frames in the median, 0 for none */
+    bool baseline;		/* Subtract a captured frame */
+    bool capture;		/* Capture the next frame as baseline */
+    size_t len;			/* Values per frame the state is for */
+    int *base;			/* Baseline */
+    int *history;		/* Last frames, for the median */
+    unsigned int next;		/* Slot of the next frame in history */
+    unsigned int filled;	/* Frames in history */
+    int32_t *acc;		/* Moving average, fixed point */
+    bool primed;		/* Moving average has been initialized */
+    uint64_t last;		/* Timestamp of the last frame */
+};
+
+int hm_filter_init(struct hm_filter *, unsigned int, unsigned int, bool);
+void hm_filter_copy(struct hm_filter *, const struct hm_filter *);
+bool hm_filter_enabled(const struct hm_filter *);
+void hm_filter_free(struct hm_filter *);
+void hm_filter_capture(struct hm_filter *);
+int hm_filter_apply(struct hm_filter *, struct hm_frame *);
+
+/* Statistics of each cell over frames */
+enum hm_stat {
+    HM_STAT_MEAN,
+    HM_STAT_STDDEV,		/* Sample standard deviation, the noise */
+    HM_STAT_VARIANCE,
+    HM_STAT_MIN,
+    HM_STAT_MAX,
+    HM_STAT_RANGE,		/* Peak to peak */
+    HM_STATS
+};
+
+struct hm_stats {
+    enum hm_stat shown;		/* Statistic replacing values */
+    bool reset;			/* Start afresh with the next frame */
+    size_t len;			/* Values per frame the state is for */
+    unsigned long count;	/* Frames accounted for */
+    double *mean;
+    double *m2;			/* Sum of squared differences to the mean */
+    int *min;
+    int *max;
+    uint64_t last;		/* Timestamp of the last frame */
+};
+
+int hm_stats_init(struct hm_stats *, const char *);
+void hm_stats_copy(struct hm_stats *, const struct hm_stats *);
+void hm_stats_free(struct hm_stats *);
+void hm_stats_reset(struct hm_stats *);
+int hm_stats_apply(struct hm_stats *, struct hm_frame *);
+int hm_stats_write(const struct hm_stats *, unsigned int, FILE *);
+
+/* Acquisition gated on the input device */
+struct hm_input {
+    int fd;			/* Event device */
+    int epfd;
+    uint64_t tail;		/* Full rate after the last event, in ns */
+    uint64_t period;		/* Idle period, in ns */
+    uint64_t last;		/* Time of the last event */
+    uint64_t next;		/* Next idle deadline */
+    bool touching;		/* BTN_TOUCH is down */
+    bool active;		/* Sampling at full rate */
+    unsigned long events;	/* Input events read */
+    unsigned long wakeups;	/* Switches to full rate */
+    unsigned long idles;	/* Frames acquired while idle */
+};
+
+int hm_input_find(const char *, char *, size_t);
+void hm_input_init(struct hm_input *, double, double);
+int hm_input_open(struct hm_input *, const char *);
+void hm_input_close(struct hm_input *);
+int hm_input_wait(struct hm_input *, struct hm_schedule *);
+
+/* Skipping of repeated frames */
+struct hm_dedup {
+    uint64_t hash;		/* Hash of the last unique frame */
+    size_t rawlen;		/* Its size, 0 before the first frame */
+    unsigned int backoff;	/* Largest number of polls per read */
+    unsigned int interval;	/* Current number of polls per read */
+    unsigned int pending;	/* Polls left to skip */
+    unsigned long frames;	/* Frames read */
+    unsigned long unique;	/* Frames differing from the previous one */
+    unsigned long skipped;	/* Polls skipped while frames repeat */
+    uint64_t start;		/* Time of the first frame */
+    uint64_t window;		/* Start of the current rate window */
+    unsigned long windowed;	/* Unique frames in the current window */
+};
+
+uint64_t hm_dedup_hash(const void *, size_t);
+void hm_dedup_init(struct hm_dedup *, unsigned int);
+bool hm_dedup_skip(struct hm_dedup *);
+bool hm_dedup_check(struct hm_dedup *, const void *, size_t, bool);
+double hm_dedup_rate(const struct hm_dedup *);
+
+/* Touch detection */
+struct hm_blobs {
+    int threshold;		/* Smallest value of a touch */
+    FILE *log;			/* Where to log blobs, or NULL */
+    const char *label;		/* Prefix of logged blobs, or NULL */
+    size_t width;		/* Geometry the state is for */
+    size_t len;
+    uint32_t *rows;		/* Labels of the previous and current rows */
+    struct hm_blob_acc *acc;	/* Statistics of each label */
+};
+
+void hm_blobs_init(struct hm_blobs *, int, FILE *);
+void hm_blobs_copy(struct hm_blobs *, const struct hm_blobs *, const char *);
+void hm_blobs_free(struct hm_blobs *);
+int hm_blobs_detect(struct hm_blobs *, size_t, struct hm_frame *);
+
+/* Decoders for the data formats */
+typedef void (*hm_decode_fn)(const void *, int *, size_t, int *, int *);
+struct hm_decoder {
+    const char *name;		/* Format name */
+    size_t unit;		/* Size of a group of values, in bytes */
+    size_t samples;		/* Number of values in a group */
+    hm_decode_fn decode;
+};
+
+const struct hm_decoder *hm_decoder_lookup(const char *);
+const struct hm_decoder *hm_decoder_list(void);
+ssize_t hm_decoder_count(const struct hm_decoder *, size_t);
+size_t hm_decoder_size(const struct hm_decoder *, size_t);
+void hm_decode_s16le(const void *, int *, size_t, int *, int *);
+
+/* Color, components from 0 to 1000 */
+struct hm_color {
+    short red;
+    short green;
+    short blue;
+};
+
+/* Part of the screen showing a heatmap */
+struct hm_display_lut {
+    short *pairs;		/* Color pair of min + i */
+    size_t allocated;		/* Number of entries pairs can hold */
+    size_t len;			/* Number of entries in use, 0 when not usable */
+    int min;			/* Range the table was built for */
+    int max;
+    bool gray;
+    bool valid;
+};
+
+struct hm_display_last {
+    short *pairs;		/* Color pair of each cell */
+    short *next;		/* Color pair of each cell of the new frame */
+    int *values;		/* Value of each cell */
+    size_t allocated;		/* Number of cells we can track */
+    size_t len;			/* Number of cells drawn */
+    unsigned int width;		/* Number of columns */
+    int min;			/* Range used to draw */
+    int max;
+    bool gray;
+    bool valid;			/* Is the screen content known? */
+};
+
+struct hm_display {
+    int y;			/* Top left corner */
+    int x;
+    int height;			/* Size, 0 for the whole screen */
+    int width;
+    struct hm_display_lut lut;	/* Value to color pair */
+    struct hm_display_last last; /* Last frame drawn */
+    size_t cwidth;		/* Geometry of the last frame drawn */
+    size_t cheight;
+    ssize_t offsetx;
+    ssize_t offsety;
+};
+
 void hm_display_init(struct hm_cfg *);
-void hm_display_data(struct hm_cfg *, int *, size_t);
+void hm_display_color(bool, int, int, struct hm_color *);
+short hm_display_level(int, int, int, int);
+void hm_display_area(struct hm_display *, int, int, int, int);
+void hm_display_reset(struct hm_display *);
+void hm_display_free(struct hm_display *);
+bool hm_display_draw(struct hm_display *, struct hm_cfg *, int *, size_t);
+void hm_display_overlay(struct hm_display *, const struct hm_frame *);
+void hm_display_data(struct hm_cfg *, const struct hm_frame *);
+void hm_display_invalidate(void);
+
+/* Direct 24-bit color renderer */
+struct hm_ansi {
+    char *sgr;			/* Escape sequence of each level */
+    int *sgrlen;		/* Length of each sequence */
+    char *half;			/* Foreground then background of each level */
+    int *halflen;
+    short *lut;			/* Level of lutmin + i */
+    size_t lutallocated;
+    size_t lutlen;		/* Entries in use, 0 when not usable */
+    int lutmin;			/* Range the table was built for */
+    int lutmax;
+    bool lutvalid;
+    char *buf;			/* Frame being composed */
+    size_t allocated;
+    size_t emitted;		/* Bytes written for the last frame */
+    size_t lines;		/* Geometry of the last frame */
+    size_t columns;
+    int sheight;
+    int swidth;
+};
+
+int hm_ansi_init(struct hm_ansi *, struct hm_cfg *);
+void hm_ansi_free(struct hm_ansi *);
+void hm_ansi_invalidate(struct hm_ansi *);
+void hm_ansi_suspend(struct hm_ansi *);
+void hm_ansi_resume(struct hm_ansi *);
+int hm_ansi_data(struct hm_ansi *, struct hm_cfg *, const struct hm_frame *);
 
 #endif
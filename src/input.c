@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+ * Gating of acquisition on the input device of the touchscreen. Frames
+ * are acquired at full rate while the surface is touched and for a
+ * while after the last input event, at a slow rate otherwise. While
+ * idle, the schedule sleeps on the input device and wakes up as soon as
+ * an event comes in.
+ */
+
+#define NSEC_PER_MSEC (1000 * 1000ULL)
+
+/* Longest sleep while idle, to notice when asked to stop */
+#define HM_INPUT_SLICE (100 * NSEC_PER_MSEC)
+
+/* Directory of evdev devices */
+#define HM_INPUT_DIR "/dev/input"
+
+/* Find the event device named name, path is filled on success */
+int
+hm_input_find(const char *name, char *path, size_t len)
+{
+    DIR *dir;
+    struct dirent *entry;
+    if (name == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    if ((dir = opendir(HM_INPUT_DIR)) == NULL) return -1;
+    while ((entry = readdir(dir)) != NULL) {
+        char candidate[PATH_MAX], found[256] = "";
+        if (strncmp(entry->d_name, "event", 5)) continue;
+        snprintf(candidate, sizeof(candidate), HM_INPUT_DIR "/%s", entry->d_name);
+        int fd = open(candidate, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) continue;
+        int ret = ioctl(fd, EVIOCGNAME(sizeof(found) - 1), found);
+        close(fd);
+        if (ret < 0 || strcmp(found, name)) continue;
+        log_debug("input", "input device %s is %s", name, candidate);
+        snprintf(path, len, "%s", candidate);
+        closedir(dir);
+        return 0;
+    }
+    closedir(dir);
+    errno = ENOENT;
+    return -1;
+}
+
+/* Full rate for tail seconds after the last event, rate per second
+ * otherwise */
+void
+hm_input_init(struct hm_input *input, double tail, double rate)
+{
+    memset(input, 0, sizeof(*input));
+    input->fd = input->epfd = -1;
+    input->tail = tail * 1e9;
+    input->period = 1e9 / rate;
+}
+
+int
+hm_input_open(struct hm_input *input, const char *path)
+{
+    input->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (input->fd == -1) return -1;
+    input->epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN };
+    if (input->epfd == -1 ||
+        epoll_ctl(input->epfd, EPOLL_CTL_ADD, input->fd, &event) == -1) {
+        int err = errno;
+        hm_input_close(input);
+        errno = err;
+        return -1;
+    }
+
+    /* The surface may already be touched. Sampling starts at full
+     * rate anyway. */
+    unsigned char keys[KEY_MAX / 8 + 1] = { 0 };
+    if (ioctl(input->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0)
+        input->touching = keys[BTN_TOUCH / 8] & (1 << (BTN_TOUCH % 8));
+    input->last = hm_schedule_now();
+    input->active = true;
+    return 0;
+}
+
+void
+hm_input_close(struct hm_input *input)
+{
+    if (input->epfd != -1) close(input->epfd);
+    if (input->fd != -1) close(input->fd);
+    input->fd = input->epfd = -1;
+}
+
+/* Read pending events. Without a device anymore, acquisition is not
+ * gated. */
+static void
+hm_input_drain(struct hm_input *input)
+{
+    struct input_event events[64];
+    ssize_t ret;
+    while ((ret = read(input->fd, events, sizeof(events))) > 0) {
+        for (size_t i = 0; i < ret / sizeof(events[0]); i++) {
+            if (events[i].type == EV_SYN) continue;
+            if (events[i].type == EV_KEY && events[i].code == BTN_TOUCH)
+                input->touching = events[i].value != 0;
+            input->events++;
+        }
+        input->last = hm_schedule_now();
+    }
+    if (ret == 0)
+        log_warnx("input", "input device is gone, acquisition is not gated anymore");
+    else if (errno != EAGAIN && errno != EINTR)
+        log_warn("input", "input device failed, acquisition is not gated anymore");
+    else
+        return;
+    hm_input_close(input);
+}
+
+static bool
+hm_input_touched(struct hm_input *input, uint64_t now)
+{
+    return input->touching || now - input->last < input->tail;
+}
+
+/* Wait for the next frame with gating. Return 0 when a frame is due,
+ * -1 when interrupted or when nothing happened for a while, to let the
+ * caller check whether it should stop. */
+int
+hm_input_wait(struct hm_input *input, struct hm_schedule *schedule)
+{
+    if (input->fd == -1) return hm_schedule_wait(schedule);
+    hm_input_drain(input);
+    if (input->fd == -1) {
+        /* Time spent idle is not an overrun */
+        if (!input->active)
+            schedule->next = hm_schedule_now() + schedule->period;
+        return hm_schedule_wait(schedule);
+    }
+
+    uint64_t now = hm_schedule_now();
+    if (hm_input_touched(input, now)) {
+        if (!input->active) {
+            /* Start at once, then at full rate */
+            input->active = true;
+            input->wakeups++;
+            schedule->next = now + schedule->period;
+            log_debug("input", "touched, sampling at full rate");
+            return 0;
+        }
+        return hm_schedule_wait(schedule);
+    }
+
+    if (input->active) {
+        input->active = false;
+        input->next = now + input->period;
+        log_debug("input", "untouched, sampling at idle rate");
+    }
+    if (now >= input->next) {
+        input->next += input->period;
+        if (input->next <= now) input->next = now + input->period;
+        input->idles++;
+        return 0;
+    }
+
+    /* Sleep until an event, the idle deadline or the end of the slice */
+    uint64_t timeout = input->next - now;
+    if (timeout > HM_INPUT_SLICE) timeout = HM_INPUT_SLICE;
+    struct epoll_event event;
+    int ret = epoll_wait(input->epfd, &event, 1,
+                         (timeout + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+    hm_latency_end(HM_STAGE_WAIT, hm_latency_enabled ? now : 0);
+    if (ret == -1) return -1;
+    errno = EAGAIN;
+    return -1;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Latency histograms, one per stage of the frame loop, with log-linear
+ * buckets. Samples may be recorded from any thread without locking.
+ */
+
+/* Largest power of two tracked, in ns (about 18 minutes) */
+#define HM_LATENCY_MAXBITS 40
+
+#define HM_LATENCY_BUCKETS HM_LOGLIN_BUCKETS(HM_LATENCY_MAXBITS)
+
+struct hm_latency_histogram {
+    uint64_t buckets[HM_LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+bool hm_latency_enabled = false;
+
+static struct hm_latency_histogram histograms[HM_STAGES];
+
+static const char *names[HM_STAGES] = {
+    [HM_STAGE_WAIT] = "wait",
+    [HM_STAGE_READ] = "read",
+    [HM_STAGE_DECODE] = "decode",
+    [HM_STAGE_FILTER] = "filter",
+    [HM_STAGE_DETECT] = "detect",
+    [HM_STAGE_STATS] = "stats",
+    [HM_STAGE_QUANTIZE] = "quantize",
+    [HM_STAGE_EMIT] = "emit",
+    [HM_STAGE_REFRESH] = "refresh",
+};
+
+static size_t
+hm_latency_bucket(uint64_t ns)
+{
+    size_t index = hm_loglin_bucket(ns);
+    if (index >= HM_LATENCY_BUCKETS) index = HM_LATENCY_BUCKETS - 1;
+    return index;
+}
+
+void
+hm_latency_record(enum hm_stage stage, uint64_t ns)
+{
+    struct hm_latency_histogram *histogram = &histograms[stage];
+    __atomic_fetch_add(&histogram->buckets[hm_latency_bucket(ns)], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, ns, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static uint64_t
+hm_latency_percentile(struct hm_latency_histogram *histogram, uint64_t count,
+                      double percentile)
+{
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    uint64_t rank = count * percentile / 100;
+    uint64_t seen = 0;
+    if (rank == 0) rank = 1;
+    for (size_t i = 0; i < HM_LATENCY_BUCKETS; i++) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= rank)
+            return (hm_loglin_high(i) < max) ? hm_loglin_high(i) : max;
+    }
+    return max;
+}
+
+/* Write percentiles of each stage, in microseconds */
+void
+hm_latency_report(FILE *out)
+{
+    fprintf(out, "%-10s %10s %10s %10s %10s %10s\n",
+            "stage", "count", "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < HM_STAGES; i++) {
+        struct hm_latency_histogram *histogram = &histograms[i];
+        uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        if (count == 0) continue;
+        fprintf(out, "%-10s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f\n",
+                names[i], count,
+                hm_latency_percentile(histogram, count, 50) / 1000.,
+                hm_latency_percentile(histogram, count, 99) / 1000.,
+                hm_latency_percentile(histogram, count, 99.9) / 1000.,
+                __atomic_load_n(&histogram->max, __ATOMIC_RELAXED) / 1000.);
+    }
+    fflush(out);
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+/* Number of frames in the ring between acquisition and rendering */
+#define HM_PIPELINE_FRAMES 8
+
+/* Give up after this many consecutive acquisition errors */
+#define HM_PIPELINE_ERRORS 5
+
+static void *
+hm_pipeline_run(void *arg)
+{
+    struct hm_pipeline *pipeline = arg;
+    struct hm_cfg *cfg = &pipeline->cfg;
+    int err = 0;
+
+    hm_schedule_init(&pipeline->schedule, cfg->rate, cfg->catchup);
+    while (!__atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED)) {
+        if ((cfg->input ? hm_input_wait(cfg->input, &pipeline->schedule) :
+             hm_schedule_wait(&pipeline->schedule)) == -1)
+            continue;
+
+        if (hm_retrieve_data(cfg, hm_ring_staging(&pipeline->ring)) <= 0) {
+            /* Nothing from a stream yet */
+            if (errno == EAGAIN || errno == EINTR) continue;
+            if (errno == EPIPE || err++ > HM_PIPELINE_ERRORS) {
+                __atomic_store_n(&pipeline->error, errno ? errno : EIO,
+                                 __ATOMIC_RELEASE);
+                sem_post(pipeline->ready);
+                break;
+            }
+            continue;
+        }
+        err = 0;
+        if (pipeline->record)
+            hm_record_frame(pipeline->record, cfg,
+                            hm_ring_staging(&pipeline->ring));
+        if (hm_ring_publish(&pipeline->ring))
+            sem_post(pipeline->ready);
+    }
+
+    hm_retrieve_close(cfg);
+    return NULL;
+}
+
+/* Start acquiring frames from a dedicated thread. The thread works on
+ * its own copy of the configuration. Each published frame posts ready,
+ * which can be shared by several pipelines, or an internal semaphore if
+ * NULL. */
+int
+hm_pipeline_start(struct hm_pipeline *pipeline, struct hm_cfg *cfg,
+                  struct hm_record *record, sem_t *ready)
+{
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->cfg = *cfg;
+    pipeline->record = record;
+    pipeline->cfg.fd = -1;
+    if (hm_ring_init(&pipeline->ring, HM_PIPELINE_FRAMES) == -1)
+        return -1;
+    pipeline->ready = ready ? ready : &pipeline->own;
+    if (sem_init(&pipeline->own, 0, 0) == -1) {
+        hm_ring_free(&pipeline->ring);
+        return -1;
+    }
+
+    /* Signals are for the rendering thread only */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    errno = pthread_create(&pipeline->thread, NULL, hm_pipeline_run, pipeline);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (errno != 0) {
+        sem_destroy(&pipeline->own);
+        hm_ring_free(&pipeline->ring);
+        return -1;
+    }
+    return 0;
+}
+
+void
+hm_pipeline_stop(struct hm_pipeline *pipeline)
+{
+    __atomic_store_n(&pipeline->stop, true, __ATOMIC_RELAXED);
+    pthread_join(pipeline->thread, NULL);
+    sem_destroy(&pipeline->own);
+    hm_ring_free(&pipeline->ring);
+}
+
+/* Wait for the newest frame. Return NULL when interrupted by a signal
+ * or if acquisition failed, in which case errno is set to the
+ * acquisition error. The frame has to be given back with
+ * hm_pipeline_release(). */
+struct hm_frame *
+hm_pipeline_next(struct hm_pipeline *pipeline)
+{
+    struct hm_frame *frame;
+    while (1) {
+        /* Wakeups are consumed before looking at the ring so that a
+         * frame published afterwards always has one pending */
+        while (sem_trywait(pipeline->ready) == 0);
+        if ((frame = hm_ring_newest(&pipeline->ring)) != NULL)
+            return frame;
+        int error = __atomic_load_n(&pipeline->error, __ATOMIC_ACQUIRE);
+        if (error) {
+            errno = error;
+            return NULL;
+        }
+        if (sem_wait(pipeline->ready) == -1) {
+            errno = 0;
+            return NULL;
+        }
+    }
+}
+
+/* Newest frame if there is a new one, NULL otherwise. errno is set to
+ * the acquisition error if acquisition failed, 0 otherwise. */
+struct hm_frame *
+hm_pipeline_poll(struct hm_pipeline *pipeline)
+{
+    struct hm_frame *frame = hm_ring_newest(&pipeline->ring);
+    if (frame == NULL)
+        errno = __atomic_load_n(&pipeline->error, __ATOMIC_ACQUIRE);
+    return frame;
+}
+
+void
+hm_pipeline_release(struct hm_pipeline *pipeline)
+{
+    hm_ring_release(&pipeline->ring);
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+/*
+ * Capture file format. All integers are little-endian.
+ *
+ *   header            struct hm_capture_header
+ *   frame, repeated   struct hm_capture_frame, then the raw frame
+ *                     padded to a multiple of 8 bytes
+ *   index             struct hm_capture_index for each frame
+ *   footer            struct hm_capture_footer
+ *
+ * Frames are appended by the acquisition side into large buffers that
+ * are written by a dedicated thread. The index is kept in memory and
+ * written when the capture is closed.
+ */
+
+/* Size of a write buffer */
+#define HM_RECORD_BUFSIZE (1024 * 1024)
+
+static void *
+hm_record_run(void *arg)
+{
+    struct hm_record *record = arg;
+
+    pthread_mutex_lock(&record->lock);
+    while (1) {
+        while (record->pending == 0 && !record->stop)
+            pthread_cond_wait(&record->cond, &record->lock);
+        if (record->pending == 0) break;
+
+        unsigned int i = record->writing;
+        pthread_mutex_unlock(&record->lock);
+
+        size_t done = 0;
+        while (done < record->used[i] && record->error == 0) {
+            ssize_t ret = write(record->fd, record->buffers[i] + done,
+                                record->used[i] - done);
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1) record->error = errno;
+            else done += ret;
+        }
+
+        pthread_mutex_lock(&record->lock);
+        record->used[i] = 0;
+        record->writing = (i + 1) % HM_RECORD_BUFFERS;
+        record->pending--;
+        pthread_cond_signal(&record->cond);
+    }
+    pthread_mutex_unlock(&record->lock);
+    return NULL;
+}
+
+int
+hm_record_open(struct hm_record *record, const char *path)
+{
+    memset(record, 0, sizeof(*record));
+    record->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (record->fd == -1) return -1;
+    for (unsigned int i = 0; i < HM_RECORD_BUFFERS; i++) {
+        record->buffers[i] = malloc(HM_RECORD_BUFSIZE);
+        if (record->buffers[i] == NULL) goto error;
+        record->allocated[i] = HM_RECORD_BUFSIZE;
+    }
+    pthread_mutex_init(&record->lock, NULL);
+    pthread_cond_init(&record->cond, NULL);
+    if ((errno = pthread_create(&record->thread, NULL,
+                                hm_record_run, record)) != 0)
+        goto error;
+    return 0;
+
+error:
+    for (unsigned int i = 0; i < HM_RECORD_BUFFERS; i++)
+        free(record->buffers[i]);
+    close(record->fd);
+    return -1;
+}
+
+/* Hand the buffer being filled to the writer thread and wait for the
+ * next one to be free */
+static void
+hm_record_queue(struct hm_record *record)
+{
+    pthread_mutex_lock(&record->lock);
+    record->pending++;
+    pthread_cond_signal(&record->cond);
+    while (record->pending == HM_RECORD_BUFFERS)
+        pthread_cond_wait(&record->cond, &record->lock);
+    record->filling = (record->filling + 1) % HM_RECORD_BUFFERS;
+    pthread_mutex_unlock(&record->lock);
+}
+
+/* Get room for size bytes in the buffer being filled */
+static char *
+hm_record_reserve(struct hm_record *record, size_t size)
+{
+    unsigned int i = record->filling;
+    if (record->used[i] + size > record->allocated[i] && record->used[i] > 0) {
+        hm_record_queue(record);
+        i = record->filling;
+    }
+    if (size > record->allocated[i]) {
+        char *new = realloc(record->buffers[i], size);
+        if (new == NULL) return NULL;
+        record->buffers[i] = new;
+        record->allocated[i] = size;
+    }
+    char *p = record->buffers[i] + record->used[i];
+    record->used[i] += size;
+    record->offset += size;
+    return p;
+}
+
+int
+hm_record_frame(struct hm_record *record, struct hm_cfg *cfg,
+                struct hm_frame *frame)
+{
+    if (record->frames == 0) {
+        struct hm_capture_header header = {
+            .magic = HM_CAPTURE_MAGIC,
+            .width = htole32(cfg->width),
+            .height = htole32(cfg->width ? frame->len / cfg->width : 0)
+        };
+        if (cfg->decoder)
+            strncpy(header.format, cfg->decoder->name, sizeof(header.format) - 1);
+        else if (cfg->format)
+            strncpy(header.format, cfg->format, sizeof(header.format) - 1);
+        char *p = hm_record_reserve(record, sizeof(header));
+        if (p == NULL) return -1;
+        memcpy(p, &header, sizeof(header));
+    }
+
+    if (record->frames == record->indexed) {
+        size_t indexed = record->indexed ? record->indexed * 2 : 1024;
+        struct hm_capture_index *new = realloc(record->index,
+                                               indexed * sizeof(*new));
+        if (new == NULL) return -1;
+        record->index = new;
+        record->indexed = indexed;
+    }
+
+    size_t padded = (frame->rawlen + 7) & ~(size_t)7;
+    struct hm_capture_frame header = {
+        .timestamp = htole64(frame->timestamp),
+        .size = htole32(frame->rawlen)
+    };
+    uint64_t offset = record->offset;
+    char *p = hm_record_reserve(record, sizeof(header) + padded);
+    if (p == NULL) return -1;
+    memcpy(p, &header, sizeof(header));
+    memcpy(p + sizeof(header), frame->raw, frame->rawlen);
+    memset(p + sizeof(header) + frame->rawlen, 0, padded - frame->rawlen);
+
+    record->index[record->frames].offset = htole64(offset);
+    record->index[record->frames].timestamp = htole64(frame->timestamp);
+    record->frames++;
+    return 0;
+}
+
+/* Flush pending frames, write the index and close the capture */
+int
+hm_record_close(struct hm_record *record)
+{
+    if (record->used[record->filling] > 0)
+        hm_record_queue(record);
+    pthread_mutex_lock(&record->lock);
+    record->stop = true;
+    pthread_cond_signal(&record->cond);
+    pthread_mutex_unlock(&record->lock);
+    pthread_join(record->thread, NULL);
+
+    struct hm_capture_footer footer = {
+        .index = htole64(record->offset),
+        .frames = htole64(record->frames),
+        .magic = HM_CAPTURE_MAGIC
+    };
+    int error = record->error;
+    const char *chunks[] = { (const char *)record->index, (const char *)&footer };
+    size_t sizes[] = { record->frames * sizeof(*record->index), sizeof(footer) };
+    for (size_t c = 0; c < 2 && error == 0; c++) {
+        size_t done = 0;
+        while (done < sizes[c]) {
+            ssize_t ret = write(record->fd, chunks[c] + done, sizes[c] - done);
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1) {
+                error = errno;
+                break;
+            }
+            done += ret;
+        }
+    }
+    if (close(record->fd) == -1 && error == 0) error = errno;
+
+    for (unsigned int i = 0; i < HM_RECORD_BUFFERS; i++)
+        free(record->buffers[i]);
+    free(record->index);
+    pthread_mutex_destroy(&record->lock);
+    pthread_cond_destroy(&record->cond);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
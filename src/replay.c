@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <limits.h>
+
+/* Map a capture file written by hm_record_*() and check its structure */
+int
+hm_replay_open(struct hm_replay *replay, const char *path)
+{
+    static const char magic[8] = HM_CAPTURE_MAGIC;
+    struct hm_capture_header header;
+    struct hm_capture_footer footer;
+    struct stat st;
+
+    memset(replay, 0, sizeof(*replay));
+    replay->speed = 1;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &st) == -1) goto error;
+    if ((size_t)st.st_size < sizeof(header) + sizeof(footer)) goto invalid;
+    replay->size = st.st_size;
+    replay->map = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (replay->map == MAP_FAILED) goto error;
+    close(fd);
+    fd = -1;
+
+    memcpy(&header, replay->map, sizeof(header));
+    memcpy(&footer, replay->map + replay->size - sizeof(footer), sizeof(footer));
+    if (memcmp(header.magic, magic, sizeof(magic)) ||
+        memcmp(footer.magic, magic, sizeof(magic)))
+        goto invalid;
+    replay->width = le32toh(header.width);
+    replay->height = le32toh(header.height);
+    if (replay->width == 0 || replay->height == 0 ||
+        replay->width > INT_MAX / replay->height)
+        goto invalid;
+    memcpy(replay->format, header.format, sizeof(header.format));
+    replay->format[sizeof(replay->format) - 1] = '\0';
+    replay->decoder = hm_decoder_lookup(replay->format);
+    if (replay->decoder == NULL) goto invalid;
+
+    uint64_t index = le64toh(footer.index);
+    uint64_t frames = le64toh(footer.frames);
+    if (index % 8 != 0 || index < sizeof(header) ||
+        index > replay->size - sizeof(footer) ||
+        frames > (replay->size - sizeof(footer) - index) / sizeof(struct hm_capture_index))
+        goto invalid;
+    replay->index = (const struct hm_capture_index *)(replay->map + index);
+    replay->frames = frames;
+    madvise((void *)replay->map, replay->size, MADV_SEQUENTIAL);
+    return 0;
+
+invalid:
+    errno = EINVAL;
+error:
+    if (fd != -1) close(fd);
+    hm_replay_close(replay);
+    return -1;
+}
+
+void
+hm_replay_close(struct hm_replay *replay)
+{
+    if (replay->map && replay->map != MAP_FAILED)
+        munmap((void *)replay->map, replay->size);
+    replay->map = NULL;
+    replay->frames = 0;
+}
+
+uint64_t
+hm_replay_timestamp(struct hm_replay *replay, size_t n)
+{
+    return le64toh(replay->index[n].timestamp);
+}
+
+/* Decode frame n straight from the mapping into frame */
+ssize_t
+hm_replay_decode(struct hm_replay *replay, size_t n, struct hm_frame *frame)
+{
+    struct hm_capture_frame header;
+    uint64_t end = (const char *)replay->index - replay->map;
+
+    if (n >= replay->frames) goto invalid;
+    uint64_t offset = le64toh(replay->index[n].offset);
+    if (end < sizeof(header) || offset > end - sizeof(header)) goto invalid;
+    memcpy(&header, replay->map + offset, sizeof(header));
+    size_t size = le32toh(header.size);
+    if (size > end - offset - sizeof(header)) goto invalid;
+    ssize_t len = hm_decoder_count(replay->decoder, size);
+    if (len == -1) goto invalid;
+
+    if (hm_frame_reserve(frame, len) == -1) return -1;
+    uint64_t start = hm_latency_start();
+    replay->decoder->decode(replay->map + offset + sizeof(header), frame->data,
+                            len, &frame->min, &frame->max);
+    hm_latency_end(HM_STAGE_DECODE, start);
+    frame->len = len;
+    frame->low = frame->min;
+    frame->high = frame->max;
+    frame->timestamp = le64toh(header.timestamp);
+    return len;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/* First frame recorded at or after timestamp */
+size_t
+hm_replay_seek(struct hm_replay *replay, uint64_t timestamp)
+{
+    size_t lo = 0, hi = replay->frames;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (hm_replay_timestamp(replay, mid) < timestamp) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < replay->frames) ? lo : replay->frames - 1;
+}
+
+/* Play frame n now, following frames are due relative to it */
+void
+hm_replay_anchor(struct hm_replay *replay, size_t n)
+{
+    replay->origin = hm_schedule_now();
+    replay->base = hm_replay_timestamp(replay, n);
+}
+
+/* Time at which frame n is due, 0 when playing as fast as possible */
+uint64_t
+hm_replay_deadline(struct hm_replay *replay, size_t n)
+{
+    if (replay->speed == 0) return 0;
+    uint64_t timestamp = hm_replay_timestamp(replay, n);
+    if (timestamp < replay->base) return replay->origin;
+    return replay->origin + (timestamp - replay->base) / replay->speed;
+}
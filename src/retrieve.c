@@ -24,50 +24,208 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <string.h>
 
-size_t
-hm_retrieve_data(struct hm_cfg *cfg, int **data)
+/* Initial size of the raw frame buffer, in bytes */
+#define HM_RAW_INITIAL 4096
+
+void
+hm_frame_free(struct hm_frame *frame)
 {
-    static size_t allocated = 0;
-    size_t len = 0;
-    int fd = open(cfg->path, O_RDONLY);
-    if (fd == -1) return 0;
+    free(frame->data);
+    free(frame->raw);
+    memset(frame, 0, sizeof(*frame));
+}
+
+/* Make room for len decoded values */
+int
+hm_frame_reserve(struct hm_frame *frame, size_t len)
+{
+    if (len <= frame->allocated) return 0;
+    int *new = realloc(frame->data, len * sizeof(int));
+    if (new == NULL) return -1;
+    frame->data = new;
+    frame->allocated = len;
+    return 0;
+}
+
+void
+hm_retrieve_close(struct hm_cfg *cfg)
+{
+    if (cfg->fd != -1) close(cfg->fd);
+    cfg->fd = -1;
+}
 
-    /* Initial memory allocation */
-    if (allocated == 0) allocated = cfg->width;
-    *data = malloc(allocated * sizeof(int));
-    if (*data == NULL) goto error;
+/* Make room for size bytes of raw data */
+static int
+hm_frame_reserve_raw(struct hm_frame *frame, size_t size)
+{
+    if (size <= frame->rawallocated) return 0;
+    char *new = realloc(frame->raw, size);
+    if (new == NULL) return -1;
+    frame->raw = new;
+    frame->rawallocated = size;
+    return 0;
+}
 
+/* Read the whole file at once. The raw buffer grows until a read comes
+ * back short, so once it has settled, a single pread() is enough to get
+ * a frame. */
+static ssize_t
+hm_retrieve_whole(struct hm_cfg *cfg, struct hm_frame *frame)
+{
+    size_t len = 0;
+    ssize_t ret;
     while (1) {
-        /* Allocate more memory if needed */
-        if (allocated == len) {
-            allocated += cfg->width;
-            int *new = realloc(*data, allocated * sizeof(int));
-            if (new == NULL) goto error;
-            *data = new;
+        if (len == frame->rawallocated &&
+            hm_frame_reserve_raw(frame, frame->rawallocated ?
+                                 frame->rawallocated * 2 : HM_RAW_INITIAL) == -1)
+            return -1;
+        ret = pread(cfg->fd, frame->raw + len,
+                    frame->rawallocated - len, len);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1) return -1;
+        len += ret;
+        if (ret == 0 || len < frame->rawallocated) break;
+    }
+    return len;
+}
+
+/* Read a frame of exactly size bytes. A file is read from the start and
+ * must hold exactly one frame. Other sources are read sequentially,
+ * one frame after the other. */
+static ssize_t
+hm_retrieve_fixed(struct hm_cfg *cfg, struct hm_frame *frame, size_t size)
+{
+    /* One more byte to detect frames that are too long */
+    if (hm_frame_reserve_raw(frame, size + 1) == -1) return -1;
+
+    size_t len = 0;
+    ssize_t ret;
+    while (len < size) {
+        if (cfg->sequential)
+            ret = read(cfg->fd, frame->raw + len, size - len);
+        else
+            ret = pread(cfg->fd, frame->raw + len, size + 1 - len, len);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1) return -1;
+        if (ret == 0) break;
+        len += ret;
+    }
+    if (len == 0 && cfg->sequential) return 0;
+    if (len != size) {
+        log_debug("retrieve", "got a frame of %zu bytes instead of %zu",
+                  len, size);
+        errno = EIO;
+        return -1;
+    }
+    return len;
+}
+
+ssize_t
+hm_retrieve_data(struct hm_cfg *cfg, struct hm_frame *frame)
+{
+    size_t len = 0;
+    ssize_t ret;
+    uint64_t start = hm_latency_start();
+
+    /* The decoder is chosen once */
+    if (cfg->decoder == NULL) {
+        cfg->decoder = hm_decoder_lookup(cfg->format);
+        if (cfg->decoder == NULL) {
+            errno = EINVAL;
+            return -1;
         }
+    }
+
+    /* Backing off while frames repeat */
+    if (cfg->dedup && hm_dedup_skip(cfg->dedup)) {
+        errno = EAGAIN;
+        return -1;
+    }
 
-        /* Read a 16-bit int */
-        int16_t blob;
-        ssize_t ret;
-        ret = read(fd, &blob, sizeof(int16_t));
-        if (ret == 0) {
-            close(fd);
-            return len;
+    if (cfg->stream) {
+        /* Streams are opened by the caller */
+        ret = hm_stream_read(cfg->stream, frame);
+        if (ret == -1) return -1;
+    } else {
+        /* The data file is kept open across frames */
+        if (cfg->fd == -1) {
+            struct stat st;
+            cfg->fd = open(cfg->path, O_RDONLY);
+            if (cfg->fd == -1) return -1;
+            if (fstat(cfg->fd, &st) == -1) goto error;
+            cfg->sequential = !S_ISREG(st.st_mode);
         }
-        if (ret == -1 && errno == EINTR) continue;
-        if (ret != 2) goto error;
 
-        /* Store it */
-        (*data)[len] = blob;
-        if (cfg->auto_min && blob < cfg->min) cfg->min = blob;
-        if (cfg->auto_max && blob > cfg->max) cfg->max = blob;
-        len += 1;
+        /* With a known geometry, frames have a fixed size. Otherwise,
+         * the whole file is a frame. */
+        if (cfg->width > 0 && cfg->height > 0)
+            ret = hm_retrieve_fixed(cfg, frame,
+                                    hm_decoder_size(cfg->decoder,
+                                                    (size_t)cfg->width * cfg->height));
+        else
+            ret = hm_retrieve_whole(cfg, frame);
+    }
+    if (ret <= 0) {
+        if (ret == 0) errno = 0;
+        goto error;
+    }
+    len = ret;
+    frame->rawlen = len;
+    if (cfg->dedup &&
+        hm_dedup_check(cfg->dedup, frame->raw, len,
+                       cfg->stream == NULL && !cfg->sequential)) {
+        /* Nothing new to process nor display */
+        hm_latency_end(HM_STAGE_READ, start);
+        errno = EAGAIN;
+        return -1;
     }
+    ret = hm_decoder_count(cfg->decoder, len);
+    if (ret == -1) {
+        errno = EIO;
+        goto error;
+    }
+    len = ret;
+    frame->timestamp = hm_schedule_now();
+    hm_latency_end(HM_STAGE_READ, start);
+
+    /* Make room for the decoded values */
+    if (hm_frame_reserve(frame, len) == -1) goto error;
+
+    start = hm_latency_start();
+    cfg->decoder->decode(frame->raw, frame->data, len, &frame->min, &frame->max);
+    frame->len = len;
+    hm_latency_end(HM_STAGE_DECODE, start);
+
+    if (cfg->filter) {
+        start = hm_latency_start();
+        if (hm_filter_apply(cfg->filter, frame) == -1) goto error;
+        hm_latency_end(HM_STAGE_FILTER, start);
+    }
+
+    if (cfg->blobs) {
+        start = hm_latency_start();
+        if (hm_blobs_detect(cfg->blobs, cfg->width, frame) == -1) goto error;
+        hm_latency_end(HM_STAGE_DETECT, start);
+    }
+
+    if (cfg->stats) {
+        start = hm_latency_start();
+        if (hm_stats_apply(cfg->stats, frame) == -1) goto error;
+        hm_latency_end(HM_STAGE_STATS, start);
+    }
+
+    frame->low = frame->min;
+    frame->high = frame->max;
+    if (cfg->autorange) hm_autorange_update(cfg->autorange, frame);
+    hm_autorange_apply(cfg, frame);
+    return len;
 
 error:
-    close(fd);
-    free(*data);
-    *data = NULL;
-    return 0;
+    /* Start afresh on next frame, buffers are kept */
+    ret = errno;
+    hm_retrieve_close(cfg);
+    errno = ret;
+    return errno ? -1 : 0;
 }
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <string.h>
+
+/*
+ * Single-producer/single-consumer ring of frames.
+ *
+ * Slots between tail and head are published and belong to the
+ * consumer. The slot at head is the staging slot where the producer
+ * decodes the next frame. The producer never publishes the last free
+ * slot: when the consumer falls behind, it keeps overwriting the staging
+ * slot instead, so the newest frame is always the next one published.
+ * The consumer only looks at the newest published frame and releases
+ * the older ones right away.
+ */
+
+int
+hm_ring_init(struct hm_ring *ring, size_t size)
+{
+    memset(ring, 0, sizeof(*ring));
+    if (size < 2) size = 2;
+    ring->slots = calloc(size, sizeof(struct hm_frame));
+    if (ring->slots == NULL) return -1;
+    ring->size = size;
+    return 0;
+}
+
+void
+hm_ring_free(struct hm_ring *ring)
+{
+    for (size_t i = 0; i < ring->size; i++)
+        hm_frame_free(&ring->slots[i]);
+    free(ring->slots);
+    ring->slots = NULL;
+    ring->size = 0;
+}
+
+/* Producer: frame to fill next */
+struct hm_frame *
+hm_ring_staging(struct hm_ring *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    return &ring->slots[head % ring->size];
+}
+
+/* Producer: make the staging frame visible to the consumer. Return
+ * false if the ring is full, the staging frame will then be
+ * overwritten by the next one. */
+bool
+hm_ring_publish(struct hm_ring *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head + 1 - tail >= ring->size) {
+        __atomic_fetch_add(&ring->overwritten, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Consumer: newest published frame or NULL if nothing new. Older frames
+ * are dropped. The frame must be given back with hm_ring_release(). */
+struct hm_frame *
+hm_ring_newest(struct hm_ring *ring)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return NULL;
+    if (head - tail > 1) {
+        __atomic_fetch_add(&ring->skipped, head - tail - 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->tail, head - 1, __ATOMIC_RELEASE);
+    }
+    return &ring->slots[(head - 1) % ring->size];
+}
+
+/* Consumer: give back the frame returned by hm_ring_newest() */
+void
+hm_ring_release(struct hm_ring *ring)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Number of frames that were never seen by the consumer */
+unsigned long
+hm_ring_dropped(struct hm_ring *ring)
+{
+    return __atomic_load_n(&ring->overwritten, __ATOMIC_RELAXED) +
+        __atomic_load_n(&ring->skipped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <errno.h>
+
+#define NSEC_PER_SEC (1000 * 1000 * 1000ULL)
+
+/* Give up catching up when late by more than this many periods */
+#define HM_SCHEDULE_BACKLOG 100
+
+static uint64_t
+hm_schedule_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static void
+hm_schedule_ts(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+uint64_t
+hm_schedule_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return hm_schedule_ns(&now);
+}
+
+/* Frames are scheduled on absolute deadlines, rate per second. A rate
+ * of 0 means as fast as possible. */
+void
+hm_schedule_init(struct hm_schedule *schedule, unsigned int rate, bool catchup)
+{
+    schedule->period = rate ? NSEC_PER_SEC / rate : 0;
+    schedule->next = hm_schedule_now() + schedule->period;
+    schedule->catchup = catchup;
+    schedule->overruns = 0;
+    schedule->skipped = 0;
+}
+
+/* Wait for the next deadline. When the deadline has already passed,
+ * return immediately and either keep the missed deadlines to catch up
+ * or skip them. Return -1 if interrupted by a signal. */
+int
+hm_schedule_wait(struct hm_schedule *schedule)
+{
+    if (schedule->period == 0) return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = hm_schedule_ns(&ts);
+
+    if (now >= schedule->next) {
+        uint64_t late = (now - schedule->next) / schedule->period;
+        schedule->overruns++;
+        if (schedule->catchup && late < HM_SCHEDULE_BACKLOG) {
+            schedule->next += schedule->period;
+        } else {
+            schedule->skipped += late;
+            schedule->next += (late + 1) * schedule->period;
+        }
+        return 0;
+    }
+
+    hm_schedule_ts(schedule->next, &ts);
+    int ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    hm_latency_end(HM_STAGE_WAIT, hm_latency_enabled ? now : 0);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+    schedule->next += schedule->period;
+    return 0;
+}
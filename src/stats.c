@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#  define HM_STATS_X86
+#  include <immintrin.h>
+#endif
+
+/*
+ * Statistics of each cell over all frames: mean and variance with
+ * Welford's algorithm, minimum and maximum. Memory only depends on the
+ * geometry. One statistic replaces the values of each frame, in the
+ * same pass as the update. The AVX2 kernel must give the exact same
+ * results as the scalar one: both multiply by the same inverse, round
+ * to nearest even and clamp before converting to integers.
+ */
+
+static const char *names[HM_STATS] = {
+    [HM_STAT_MEAN] = "mean",
+    [HM_STAT_STDDEV] = "stddev",
+    [HM_STAT_VARIANCE] = "variance",
+    [HM_STAT_MIN] = "min",
+    [HM_STAT_MAX] = "max",
+    [HM_STAT_RANGE] = "range",
+};
+
+/* What to do with a frame */
+struct hm_stats_pass {
+    int *data;
+    double *mean;
+    double *m2;
+    int *min;
+    int *max;
+    double inv;			/* 1 / count */
+    double sample;		/* 1 / (count - 1), 0 for the first frame */
+    enum hm_stat shown;
+    bool first;			/* Start the statistics here */
+};
+
+/* Update statistics from start to len, replace values by the shown
+ * statistic and return their extent */
+typedef void (*hm_stats_fn)(const struct hm_stats_pass *, size_t, size_t,
+                            int *, int *);
+
+static inline int
+hm_stats_int(double x)
+{
+    if (x > INT_MAX) x = INT_MAX;
+    if (x < INT_MIN) x = INT_MIN;
+    return lrint(x);
+}
+
+static void
+hm_stats_scalar(const struct hm_stats_pass *p, size_t start, size_t len,
+                int *min, int *max)
+{
+    const struct hm_stats_pass q = *p;
+    int lmin = INT_MAX, lmax = INT_MIN;
+    for (size_t i = start; i < len; i++) {
+        int x = q.data[i];
+        double mean = q.mean[i], m2 = q.m2[i];
+        int vmin = q.min[i], vmax = q.max[i];
+        if (q.first) {
+            mean = x;
+            m2 = 0;
+            vmin = vmax = x;
+        } else {
+            double delta = x - mean;
+            mean += delta * q.inv;
+            m2 += delta * (x - mean);
+            if (x < vmin) vmin = x;
+            if (x > vmax) vmax = x;
+        }
+        q.mean[i] = mean;
+        q.m2[i] = m2;
+        q.min[i] = vmin;
+        q.max[i] = vmax;
+
+        switch (q.shown) {
+        case HM_STAT_MEAN: x = hm_stats_int(mean); break;
+        case HM_STAT_STDDEV: x = hm_stats_int(sqrt(m2 * q.sample)); break;
+        case HM_STAT_VARIANCE: x = hm_stats_int(m2 * q.sample); break;
+        case HM_STAT_MIN: x = vmin; break;
+        case HM_STAT_MAX: x = vmax; break;
+        default: x = (int)((unsigned int)vmax - (unsigned int)vmin); break;
+        }
+        q.data[i] = x;
+        if (x < lmin) lmin = x;
+        if (x > lmax) lmax = x;
+    }
+    *min = lmin;
+    *max = lmax;
+}
+
+#ifdef HM_STATS_X86
+
+__attribute__((target("avx2")))
+static inline __m128i
+hm_stats_int_avx2(__m256d x)
+{
+    x = _mm256_min_pd(x, _mm256_set1_pd(INT_MAX));
+    x = _mm256_max_pd(x, _mm256_set1_pd(INT_MIN));
+    return _mm256_cvtpd_epi32(x);
+}
+
+__attribute__((target("avx2")))
+static void
+hm_stats_avx2(const struct hm_stats_pass *p, size_t start, size_t len,
+              int *min, int *max)
+{
+    const struct hm_stats_pass q = *p;
+    const __m256d inv = _mm256_set1_pd(q.inv);
+    const __m256d sample = _mm256_set1_pd(q.sample);
+    __m128i vlmin = _mm_set1_epi32(INT_MAX);
+    __m128i vlmax = _mm_set1_epi32(INT_MIN);
+    size_t i = start;
+    for (; i + 4 <= len; i += 4) {
+        __m128i xi = _mm_loadu_si128((const __m128i *)(q.data + i));
+        __m256d x = _mm256_cvtepi32_pd(xi);
+        __m256d mean, m2;
+        __m128i vmin, vmax;
+        if (q.first) {
+            mean = x;
+            m2 = _mm256_setzero_pd();
+            vmin = vmax = xi;
+        } else {
+            mean = _mm256_loadu_pd(q.mean + i);
+            __m256d delta = _mm256_sub_pd(x, mean);
+            mean = _mm256_add_pd(mean, _mm256_mul_pd(delta, inv));
+            m2 = _mm256_add_pd(_mm256_loadu_pd(q.m2 + i),
+                               _mm256_mul_pd(delta, _mm256_sub_pd(x, mean)));
+            vmin = _mm_min_epi32(_mm_loadu_si128((const __m128i *)(q.min + i)), xi);
+            vmax = _mm_max_epi32(_mm_loadu_si128((const __m128i *)(q.max + i)), xi);
+        }
+        _mm256_storeu_pd(q.mean + i, mean);
+        _mm256_storeu_pd(q.m2 + i, m2);
+        _mm_storeu_si128((__m128i *)(q.min + i), vmin);
+        _mm_storeu_si128((__m128i *)(q.max + i), vmax);
+
+        switch (q.shown) {
+        case HM_STAT_MEAN: xi = hm_stats_int_avx2(mean); break;
+        case HM_STAT_STDDEV:
+            xi = hm_stats_int_avx2(_mm256_sqrt_pd(_mm256_mul_pd(m2, sample)));
+            break;
+        case HM_STAT_VARIANCE: xi = hm_stats_int_avx2(_mm256_mul_pd(m2, sample)); break;
+        case HM_STAT_MIN: xi = vmin; break;
+        case HM_STAT_MAX: xi = vmax; break;
+        default: xi = _mm_sub_epi32(vmax, vmin); break;
+        }
+        _mm_storeu_si128((__m128i *)(q.data + i), xi);
+        vlmin = _mm_min_epi32(vlmin, xi);
+        vlmax = _mm_max_epi32(vlmax, xi);
+    }
+
+    /* Vectors are reduced first, so that the upper halves of registers
+     * are clean in the scalar code */
+    int rmin = INT_MAX, rmax = INT_MIN, lmin, lmax, t[4];
+    _mm_storeu_si128((__m128i *)t, vlmin);
+    for (int k = 0; k < 4; k++) if (t[k] < rmin) rmin = t[k];
+    _mm_storeu_si128((__m128i *)t, vlmax);
+    for (int k = 0; k < 4; k++) if (t[k] > rmax) rmax = t[k];
+    _mm256_zeroupper();
+    hm_stats_scalar(p, i, len, &lmin, &lmax);
+    *min = lmin < rmin ? lmin : rmin;
+    *max = lmax > rmax ? lmax : rmax;
+}
+
+#endif
+
+/* Best kernel for this CPU, picked on first use */
+static hm_stats_fn
+hm_stats_kernel(void)
+{
+    static hm_stats_fn kernel = NULL;
+    hm_stats_fn k = __atomic_load_n(&kernel, __ATOMIC_ACQUIRE);
+    if (k) return k;
+    k = hm_stats_scalar;
+#ifdef HM_STATS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) k = hm_stats_avx2;
+#endif
+    log_debug("stats", "using %s statistics",
+              k == hm_stats_scalar ? "scalar" : "avx2");
+    __atomic_store_n(&kernel, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+/* Statistics showing the one named name */
+int
+hm_stats_init(struct hm_stats *stats, const char *name)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < HM_STATS; i++) {
+        if (strcmp(name, names[i])) continue;
+        stats->shown = i;
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/* The same statistic, with state of its own */
+void
+hm_stats_copy(struct hm_stats *stats, const struct hm_stats *from)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->shown = from->shown;
+}
+
+void
+hm_stats_free(struct hm_stats *stats)
+{
+    free(stats->mean);
+    free(stats->m2);
+    free(stats->min);
+    free(stats->max);
+    stats->mean = stats->m2 = NULL;
+    stats->min = stats->max = NULL;
+    stats->len = 0;
+}
+
+/* Start afresh with the next frame. May be called from any thread. */
+void
+hm_stats_reset(struct hm_stats *stats)
+{
+    __atomic_store_n(&stats->reset, true, __ATOMIC_RELAXED);
+}
+
+/* Allocate state for frames of len values */
+static int
+hm_stats_setup(struct hm_stats *stats, size_t len)
+{
+    hm_stats_free(stats);
+    stats->mean = malloc(len * sizeof(double));
+    stats->m2 = malloc(len * sizeof(double));
+    stats->min = malloc(len * sizeof(int));
+    stats->max = malloc(len * sizeof(int));
+    if (stats->mean == NULL || stats->m2 == NULL ||
+        stats->min == NULL || stats->max == NULL) {
+        hm_stats_free(stats);
+        return -1;
+    }
+    stats->len = len;
+    stats->count = 0;
+    return 0;
+}
+
+/* Account for a frame and replace its values by the shown statistic */
+int
+hm_stats_apply(struct hm_stats *stats, struct hm_frame *frame)
+{
+    if (frame->len == 0) return 0;
+    hm_stats_fn kernel = hm_stats_kernel();
+
+    /* Statistics start afresh with a new geometry or when going back in
+     * time, like when seeking in a capture */
+    if (frame->len != stats->len && hm_stats_setup(stats, frame->len) == -1)
+        return -1;
+    if (__atomic_exchange_n(&stats->reset, false, __ATOMIC_RELAXED) ||
+        frame->timestamp < stats->last)
+        stats->count = 0;
+    stats->last = frame->timestamp;
+
+    stats->count++;
+    struct hm_stats_pass pass = {
+        .data = frame->data,
+        .mean = stats->mean,
+        .m2 = stats->m2,
+        .min = stats->min,
+        .max = stats->max,
+        .inv = 1. / stats->count,
+        .sample = stats->count > 1 ? 1. / (stats->count - 1) : 0,
+        .shown = stats->shown,
+        .first = stats->count == 1
+    };
+    kernel(&pass, 0, frame->len, &frame->min, &frame->max);
+    return 0;
+}
+
+/* Write all statistics as matrices of width columns */
+int
+hm_stats_write(const struct hm_stats *stats, unsigned int width, FILE *out)
+{
+    if (width == 0) width = stats->len ? stats->len : 1;
+    fprintf(out, "# %lu frames, %zu cells in rows of %u\n",
+            stats->count, stats->len, width);
+    for (int s = 0; s < HM_STATS; s++) {
+        if (s == HM_STAT_VARIANCE || s == HM_STAT_RANGE) continue;
+        fprintf(out, "\n# %s\n", names[s]);
+        for (size_t i = 0; i < stats->len && stats->count > 0; i++) {
+            double sample = stats->count > 1 ? stats->m2[i] / (stats->count - 1) : 0;
+            switch (s) {
+            case HM_STAT_MEAN: fprintf(out, "%.3f", stats->mean[i]); break;
+            case HM_STAT_STDDEV: fprintf(out, "%.3f", sqrt(sample)); break;
+            case HM_STAT_MIN: fprintf(out, "%d", stats->min[i]); break;
+            case HM_STAT_MAX: fprintf(out, "%d", stats->max[i]); break;
+            }
+            fputc((i + 1) % width == 0 || i + 1 == stats->len ? '\n' : ' ', out);
+        }
+    }
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2014 Zodiac Inflight Innovations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "heatmap.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Stream of back-to-back frames of a fixed size, from stdin, a FIFO or
+ * a Unix socket. Everything available is read in a large buffer with
+ * non-blocking reads and only the latest complete frame is kept: when
+ * the renderer is late, older frames are dropped instead of piling up.
+ */
+
+/* Minimum size of the read buffer, in bytes */
+#define HM_STREAM_BUFFER (1024 * 1024)
+
+/* How long to wait for a frame before giving control back, in ms */
+#define HM_STREAM_TIMEOUT 100
+
+/* Open path, "-" for stdin, for frames of size bytes */
+int
+hm_stream_open(struct hm_stream *stream, const char *path, size_t size)
+{
+    struct stat st;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = -1;
+    if (size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    stream->size = size;
+    stream->allocated = 2 * size > HM_STREAM_BUFFER ? 2 * size : HM_STREAM_BUFFER;
+    stream->buf = malloc(stream->allocated);
+    if (stream->buf == NULL) return -1;
+
+    if (!strcmp(path, "-")) {
+        stream->fd = STDIN_FILENO;
+    } else if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            goto error;
+        }
+        strcpy(addr.sun_path, path);
+        stream->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (stream->fd == -1) goto error;
+        if (connect(stream->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+            goto error;
+    } else {
+        /* Don't wait for a writer to open a FIFO, but don't take its
+         * absence for the end of the stream either */
+        stream->fd = open(path, O_RDONLY | O_NONBLOCK);
+        if (stream->fd == -1) goto error;
+        stream->pending = fstat(stream->fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    }
+
+    int flags = fcntl(stream->fd, F_GETFL);
+    if (flags == -1 || fcntl(stream->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        goto error;
+    return 0;
+
+error:
+    hm_stream_close(stream);
+    return -1;
+}
+
+void
+hm_stream_close(struct hm_stream *stream)
+{
+    int err = errno;
+    if (stream->fd > STDIN_FILENO) close(stream->fd);
+    stream->fd = -1;
+    free(stream->buf);
+    stream->buf = NULL;
+    errno = err;
+}
+
+/* Keep only the last complete frame and what follows */
+static void
+hm_stream_trim(struct hm_stream *stream)
+{
+    size_t complete = stream->len / stream->size;
+    if (complete <= 1) return;
+    size_t drop = (complete - 1) * stream->size;
+    memmove(stream->buf, stream->buf + drop, stream->len - drop);
+    stream->len -= drop;
+    stream->dropped += complete - 1;
+}
+
+/* Read everything available without blocking */
+static int
+hm_stream_drain(struct hm_stream *stream)
+{
+    while (!stream->eof) {
+        if (stream->len == stream->allocated) hm_stream_trim(stream);
+        ssize_t ret = read(stream->fd, stream->buf + stream->len,
+                           stream->allocated - stream->len);
+        if (ret > 0) {
+            stream->len += ret;
+            stream->pending = false;
+            continue;
+        }
+        if (ret == 0 && stream->pending) break;
+        if (ret == 0) stream->eof = true;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        else if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+/* Get the latest complete frame in frame->raw. Return its size, or -1
+ * with errno set to EAGAIN when no frame came in for a while and EPIPE
+ * at the end of the stream. */
+ssize_t
+hm_stream_read(struct hm_stream *stream, struct hm_frame *frame)
+{
+    while (1) {
+        if (hm_stream_drain(stream) == -1) return -1;
+        hm_stream_trim(stream);
+        if (stream->len >= stream->size) break;
+        if (stream->eof) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        struct pollfd pfd = { .fd = stream->fd, .events = POLLIN };
+        int ret = poll(&pfd, 1, HM_STREAM_TIMEOUT);
+        if (ret == -1) return -1;
+        if (ret == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (stream->pending && !(pfd.revents & POLLIN)) {
+            /* Hung up before writing anything, wait for another writer */
+            poll(NULL, 0, HM_STREAM_TIMEOUT);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    if (frame->rawallocated < stream->size) {
+        char *new = realloc(frame->raw, stream->size);
+        if (new == NULL) return -1;
+        frame->raw = new;
+        frame->rawallocated = stream->size;
+    }
+    memcpy(frame->raw, stream->buf, stream->size);
+    stream->len -= stream->size;
+    memmove(stream->buf, stream->buf + stream->size, stream->len);
+    stream->frames++;
+    return stream->size;
+}